@@ -0,0 +1,441 @@
+#include "apic.h"
+#include "../cpu/cpu.h"
+#include "../paging/vmm/vmm.h"
+#include "../../../driver/acpi/acpi.h"
+
+// ============================================================================
+// Registers
+// ============================================================================
+
+// Local APIC register offsets; in x2APIC mode register r is MSR 0x800 + r / 16
+#define LAPIC_ID          0x020
+#define LAPIC_TPR         0x080
+#define LAPIC_EOI         0x0B0
+#define LAPIC_SVR         0x0F0
+#define LAPIC_LVT_LINT0   0x350
+#define LAPIC_LVT_LINT1   0x360
+#define LAPIC_MMIO_SIZE   0x400
+
+#define X2APIC_MSR_BASE   0x800
+
+#define LAPIC_SVR_ENABLE  (1U << 8)
+#define LVT_DELIVERY_NMI  (4U << 8)
+#define LVT_ACTIVE_LOW    (1U << 13)
+
+// IOAPIC: an index register and a data window
+#define IOAPIC_REGSEL     0x00
+#define IOAPIC_WINDOW     0x10
+#define IOAPIC_MMIO_SIZE  0x20
+#define IOAPIC_REG_VER    0x01
+#define IOAPIC_REG_REDTBL 0x10   // two 32-bit registers per input
+#define IOAPIC_MASKED     (1U << 16)
+
+// Polarity and trigger fields of MADT interrupt flags (MPS INTI format)
+#define MPS_POLARITY_MASK 0x3
+#define MPS_ACTIVE_LOW    0x3
+#define MPS_TRIGGER_MASK  0xC
+#define MPS_LEVEL         0xC
+
+#define PIC1_DATA         0x21
+#define PIC2_DATA         0xA1
+
+// ============================================================================
+// MADT Layout
+// ============================================================================
+
+struct madt {
+    struct acpi_sdt_header header;
+    uint32_t lapic_address;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct madt_entry {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+#define MADT_LAPIC           0
+#define MADT_IOAPIC          1
+#define MADT_SOURCE_OVERRIDE 2
+#define MADT_LAPIC_NMI       4
+#define MADT_LAPIC_ADDRESS   5
+#define MADT_X2APIC          9
+#define MADT_X2APIC_NMI      10
+
+#define MADT_CPU_ENABLED        (1U << 0)
+#define MADT_CPU_ONLINE_CAPABLE (1U << 1)
+#define MADT_NMI_ALL_CPUS       0xFFFFFFFF
+
+struct madt_lapic {
+    struct madt_entry entry;
+    uint8_t  uid;
+    uint8_t  apic_id;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct madt_ioapic {
+    struct madt_entry entry;
+    uint8_t  id;
+    uint8_t  reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+} __attribute__((packed));
+
+struct madt_source_override {
+    struct madt_entry entry;
+    uint8_t  bus;
+    uint8_t  source;          // ISA IRQ
+    uint32_t gsi;
+    uint16_t flags;
+} __attribute__((packed));
+
+struct madt_lapic_nmi {
+    struct madt_entry entry;
+    uint8_t  uid;             // 0xFF = all processors
+    uint16_t flags;
+    uint8_t  lint;
+} __attribute__((packed));
+
+struct madt_lapic_address {
+    struct madt_entry entry;
+    uint16_t reserved;
+    uint64_t address;
+} __attribute__((packed));
+
+struct madt_x2apic {
+    struct madt_entry entry;
+    uint16_t reserved;
+    uint32_t apic_id;
+    uint32_t flags;
+    uint32_t uid;
+} __attribute__((packed));
+
+struct madt_x2apic_nmi {
+    struct madt_entry entry;
+    uint16_t flags;
+    uint32_t uid;             // 0xFFFFFFFF = all processors
+    uint8_t  lint;
+    uint8_t  reserved[3];
+} __attribute__((packed));
+
+// ============================================================================
+// State
+// ============================================================================
+
+struct ioapic {
+    uint64_t phys;
+    volatile uint32_t* regs;
+    uint32_t gsi_base;
+    uint32_t gsi_count;
+};
+
+struct lapic_nmi {
+    uint32_t uid;
+    uint16_t flags;
+    uint8_t  lint;
+};
+
+#define MAX_LAPIC_NMIS 8
+
+static bool enabled = false;
+static bool x2apic = false;
+static volatile uint32_t* lapic_mmio = NULL;
+
+static uint32_t cpu_apic_ids[MAX_CPUS];
+static uint32_t cpu_uids[MAX_CPUS];
+static uint32_t cpu_count = 0;
+
+static struct ioapic ioapics[APIC_MAX_IOAPICS];
+static uint32_t ioapic_count = 0;
+static spinlock_t ioapic_lock = SPINLOCK_INIT;
+
+// ISA IRQ -> GSI and MPS flags; identity with bus defaults unless overridden
+static uint32_t isa_gsi[16];
+static uint16_t isa_flags[16];
+
+static struct lapic_nmi lapic_nmis[MAX_LAPIC_NMIS];
+static uint32_t lapic_nmi_count = 0;
+
+static inline void outb(uint16_t port, uint8_t val) {
+    asm volatile("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+
+// ============================================================================
+// Local APIC Access
+// ============================================================================
+
+static uint32_t lapic_read(uint32_t reg) {
+    if (x2apic) return (uint32_t)cpu_read_msr(X2APIC_MSR_BASE + (reg >> 4));
+    return lapic_mmio[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+    if (x2apic) cpu_write_msr(X2APIC_MSR_BASE + (reg >> 4), value);
+    else lapic_mmio[reg / 4] = value;
+}
+
+static uint32_t lapic_id(void) {
+    uint32_t id = lapic_read(LAPIC_ID);
+    return x2apic ? id : id >> 24;
+}
+
+void apic_eoi(void) {
+    if (x2apic) cpu_write_msr(X2APIC_MSR_BASE + (LAPIC_EOI >> 4), 0);
+    else lapic_mmio[LAPIC_EOI / 4] = 0;
+}
+
+bool apic_enabled(void) {
+    return enabled;
+}
+
+// ============================================================================
+// IOAPIC Access
+// ============================================================================
+
+static uint32_t ioapic_read(struct ioapic* io, uint32_t reg) {
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    return io->regs[IOAPIC_WINDOW / 4];
+}
+
+static void ioapic_write(struct ioapic* io, uint32_t reg, uint32_t value) {
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    io->regs[IOAPIC_WINDOW / 4] = value;
+}
+
+static struct ioapic* ioapic_for_gsi(uint32_t gsi) {
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        if (gsi >= ioapics[i].gsi_base && gsi - ioapics[i].gsi_base < ioapics[i].gsi_count) {
+            return &ioapics[i];
+        }
+    }
+    return NULL;
+}
+
+// ============================================================================
+// MADT Parsing
+// ============================================================================
+
+static void add_cpu(uint32_t apic_id, uint32_t uid, uint32_t flags) {
+    // Disabled entries that cannot be brought online are placeholders
+    if (!(flags & (MADT_CPU_ENABLED | MADT_CPU_ONLINE_CAPABLE))) return;
+    if (cpu_count == MAX_CPUS) return;
+    cpu_apic_ids[cpu_count] = apic_id;
+    cpu_uids[cpu_count] = uid;
+    cpu_count++;
+}
+
+static void add_nmi(uint32_t uid, uint16_t flags, uint8_t lint) {
+    if (lapic_nmi_count == MAX_LAPIC_NMIS) return;
+    lapic_nmis[lapic_nmi_count++] = (struct lapic_nmi){ uid, flags, lint };
+}
+
+// Only recorded here: the MMIO window cannot give space back, so nothing
+// is mapped until the whole MADT has been validated
+static void add_ioapic(uint32_t address, uint32_t gsi_base) {
+    if (ioapic_count == APIC_MAX_IOAPICS) return;
+    ioapics[ioapic_count++] = (struct ioapic){ address, NULL, gsi_base, 0 };
+}
+
+static bool map_ioapics(void) {
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        struct ioapic* io = &ioapics[i];
+        io->regs = vmm_map_mmio(io->phys, IOAPIC_MMIO_SIZE, VMM_CACHE_UC);
+        if (!io->regs) return false;
+        io->gsi_count = ((ioapic_read(io, IOAPIC_REG_VER) >> 16) & 0xFF) + 1;
+    }
+    return true;
+}
+
+// Copies everything needed out of the MADT; returns the local APIC address
+static uint64_t parse_madt(const struct madt* madt) {
+    uint64_t lapic_address = madt->lapic_address;
+    const uint8_t* p = (const uint8_t*)(madt + 1);
+    const uint8_t* end = (const uint8_t*)madt + madt->header.length;
+    
+    for (int irq = 0; irq < 16; irq++) {
+        isa_gsi[irq] = irq;
+        isa_flags[irq] = 0;
+    }
+    
+    while (p + sizeof(struct madt_entry) <= end) {
+        const struct madt_entry* entry = (const struct madt_entry*)p;
+        if (entry->length < sizeof(struct madt_entry) || p + entry->length > end) break;
+        
+        switch (entry->type) {
+        case MADT_LAPIC: {
+            const struct madt_lapic* e = (const void*)entry;
+            add_cpu(e->apic_id, e->uid, e->flags);
+            break;
+        }
+        case MADT_X2APIC: {
+            const struct madt_x2apic* e = (const void*)entry;
+            add_cpu(e->apic_id, e->uid, e->flags);
+            break;
+        }
+        case MADT_IOAPIC: {
+            const struct madt_ioapic* e = (const void*)entry;
+            add_ioapic(e->address, e->gsi_base);
+            break;
+        }
+        case MADT_SOURCE_OVERRIDE: {
+            const struct madt_source_override* e = (const void*)entry;
+            if (e->bus == 0 && e->source < 16) {
+                isa_gsi[e->source] = e->gsi;
+                isa_flags[e->source] = e->flags;
+            }
+            break;
+        }
+        case MADT_LAPIC_NMI: {
+            const struct madt_lapic_nmi* e = (const void*)entry;
+            add_nmi(e->uid == 0xFF ? MADT_NMI_ALL_CPUS : e->uid, e->flags, e->lint);
+            break;
+        }
+        case MADT_X2APIC_NMI: {
+            const struct madt_x2apic_nmi* e = (const void*)entry;
+            add_nmi(e->uid, e->flags, e->lint);
+            break;
+        }
+        case MADT_LAPIC_ADDRESS: {
+            const struct madt_lapic_address* e = (const void*)entry;
+            lapic_address = e->address;
+            break;
+        }
+        }
+        p += entry->length;
+    }
+    return lapic_address;
+}
+
+// ============================================================================
+// Initialization
+// ============================================================================
+
+// Route the LINT pins wired to NMI on this CPU, as the MADT describes
+static void setup_lint_nmis(uint32_t uid) {
+    for (uint32_t i = 0; i < lapic_nmi_count; i++) {
+        struct lapic_nmi* nmi = &lapic_nmis[i];
+        if (nmi->uid != MADT_NMI_ALL_CPUS && nmi->uid != uid) continue;
+        if (nmi->lint > 1) continue;
+        uint32_t lvt = LVT_DELIVERY_NMI;
+        if ((nmi->flags & MPS_POLARITY_MASK) == MPS_ACTIVE_LOW) lvt |= LVT_ACTIVE_LOW;
+        lapic_write(nmi->lint ? LAPIC_LVT_LINT1 : LAPIC_LVT_LINT0, lvt);
+    }
+}
+
+bool apic_init(void) {
+    uint32_t a, b, feat_ecx, feat_edx;
+    cpu_cpuid(1, 0, &a, &b, &feat_ecx, &feat_edx);
+    if (!(feat_edx & CPUID_FEAT_APIC)) return false;
+    
+    const struct madt* madt = (const struct madt*)acpi_find_table("APIC");
+    if (!madt) return false;
+    
+    cpu_count = 0;
+    ioapic_count = 0;
+    lapic_nmi_count = 0;
+    uint64_t lapic_address = parse_madt(madt);
+    if (!lapic_address || ioapic_count == 0 || cpu_count == 0) return false;
+    if (!map_ioapics()) return false;
+    
+    x2apic = (feat_ecx & CPUID_FEAT_X2APIC) != 0;
+    if (!x2apic) {
+        lapic_mmio = vmm_map_mmio(lapic_address, LAPIC_MMIO_SIZE, VMM_CACHE_UC);
+        if (!lapic_mmio) return false;
+    }
+    
+    uint64_t irq = cpu_irq_save();
+    
+    // The PIC stays remapped to vectors 32-47 so a stray interrupt raised
+    // while masking does not look like an exception
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+    
+    // Going from disabled straight to x2APIC is invalid: enable xAPIC first
+    uint64_t base = cpu_read_msr(MSR_APIC_BASE) | APIC_BASE_ENABLE;
+    cpu_write_msr(MSR_APIC_BASE, base);
+    if (x2apic) cpu_write_msr(MSR_APIC_BASE, base | APIC_BASE_X2APIC);
+    
+    // Keep the bootstrap processor at index 0 so callers can target "cpu 0"
+    uint32_t self = lapic_id();
+    for (uint32_t i = 1; i < cpu_count; i++) {
+        if (cpu_apic_ids[i] != self) continue;
+        uint32_t id = cpu_apic_ids[0], uid = cpu_uids[0];
+        cpu_apic_ids[0] = cpu_apic_ids[i];
+        cpu_uids[0] = cpu_uids[i];
+        cpu_apic_ids[i] = id;
+        cpu_uids[i] = uid;
+        break;
+    }
+    
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+    setup_lint_nmis(cpu_uids[0]);
+    
+    // Nothing is delivered until a driver routes its line
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        for (uint32_t pin = 0; pin < ioapics[i].gsi_count; pin++) {
+            ioapic_write(&ioapics[i], IOAPIC_REG_REDTBL + pin * 2, IOAPIC_MASKED);
+        }
+    }
+    
+    enabled = true;
+    cpu_irq_restore(irq);
+    return true;
+}
+
+// ============================================================================
+// CPUs
+// ============================================================================
+
+uint32_t apic_cpu_count(void) {
+    return cpu_count;
+}
+
+uint32_t apic_cpu_apic_id(uint32_t cpu) {
+    return cpu < cpu_count ? cpu_apic_ids[cpu] : 0;
+}
+
+// ============================================================================
+// Interrupt Routing
+// ============================================================================
+
+bool apic_route_gsi(uint32_t gsi, uint8_t vector, uint32_t cpu, uint32_t flags) {
+    if (!enabled || cpu >= cpu_count) return false;
+    struct ioapic* io = ioapic_for_gsi(gsi);
+    if (!io) return false;
+    
+    // Without interrupt remapping the IOAPIC destination field is 8 bits wide
+    uint32_t dest = cpu_apic_ids[cpu];
+    if (dest > 0xFF) return false;
+    
+    // Fixed delivery, physical destination
+    uint32_t low = vector | (flags & (APIC_IRQ_ACTIVE_LOW | APIC_IRQ_LEVEL));
+    uint32_t reg = IOAPIC_REG_REDTBL + (gsi - io->gsi_base) * 2;
+    
+    // Destination first: the entry unmasks when the low half is written
+    uint64_t irq = spin_lock_irqsave(&ioapic_lock);
+    ioapic_write(io, reg + 1, dest << 24);
+    ioapic_write(io, reg, low);
+    spin_unlock_irqrestore(&ioapic_lock, irq);
+    return true;
+}
+
+bool apic_route_isa_irq(uint8_t irq, uint8_t vector, uint32_t cpu) {
+    if (irq >= 16) return false;
+    
+    // ISA lines are edge-triggered and active-high unless overridden
+    uint32_t flags = 0;
+    if ((isa_flags[irq] & MPS_POLARITY_MASK) == MPS_ACTIVE_LOW) flags |= APIC_IRQ_ACTIVE_LOW;
+    if ((isa_flags[irq] & MPS_TRIGGER_MASK) == MPS_LEVEL) flags |= APIC_IRQ_LEVEL;
+    return apic_route_gsi(isa_gsi[irq], vector, cpu, flags);
+}
+
+void apic_mask_gsi(uint32_t gsi) {
+    struct ioapic* io = ioapic_for_gsi(gsi);
+    if (!io) return;
+    
+    uint32_t reg = IOAPIC_REG_REDTBL + (gsi - io->gsi_base) * 2;
+    uint64_t irq = spin_lock_irqsave(&ioapic_lock);
+    ioapic_write(io, reg, ioapic_read(io, reg) | IOAPIC_MASKED);
+    spin_unlock_irqrestore(&ioapic_lock, irq);
+}
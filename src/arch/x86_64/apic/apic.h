@@ -0,0 +1,51 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// ============================================================================
+// Interrupt Vectors
+// ============================================================================
+
+// ISA IRQ n is delivered on IRQ_VECTOR_BASE + n, the same vectors the
+// remapped 8259 PIC used, so handlers do not move when the APIC takes over
+#define IRQ_VECTOR_BASE       32
+#define APIC_SPURIOUS_VECTOR  0xFF
+
+#define APIC_MAX_IOAPICS      8
+
+// Redirection flags for apic_route_gsi(); ISA IRQs default to edge/high
+#define APIC_IRQ_ACTIVE_LOW   (1U << 13)
+#define APIC_IRQ_LEVEL        (1U << 15)
+
+// ============================================================================
+// APIC Functions
+// ============================================================================
+
+// Parse the MADT, enable the local APIC (x2APIC mode when supported), mask
+// every IOAPIC input and mask the 8259 PIC. Needs acpi_init() and the VMM,
+// and must run before ACPI-reclaimable memory is released.
+// Returns false (PIC left in charge) when there is no usable MADT.
+bool apic_init(void);
+
+// True once interrupts are delivered through the local APIC
+bool apic_enabled(void);
+
+// End of interrupt: one MSR write in x2APIC mode, one MMIO store otherwise
+void apic_eoi(void);
+
+// CPUs listed in the MADT; index 0 is the bootstrap processor
+uint32_t apic_cpu_count(void);
+uint32_t apic_cpu_apic_id(uint32_t cpu);
+
+// Deliver global system interrupt gsi to CPU index cpu on vector
+bool apic_route_gsi(uint32_t gsi, uint8_t vector, uint32_t cpu, uint32_t flags);
+
+// Same for a legacy ISA IRQ, following the MADT source overrides
+bool apic_route_isa_irq(uint8_t irq, uint8_t vector, uint32_t cpu);
+
+// Stop delivering gsi
+void apic_mask_gsi(uint32_t gsi);
+
+#endif // APIC_H
@@ -0,0 +1,143 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+// ============================================================================
+// CPU Identification
+// ============================================================================
+
+#define MAX_CPUS 16
+
+// Only the bootstrap processor runs kernel code for now, so every per-CPU
+// structure is indexed with 0. This becomes a real lookup once APs are started.
+static inline uint32_t cpu_id(void) {
+    return 0;
+}
+
+// ============================================================================
+// CPUID / MSR
+// ============================================================================
+
+static inline void cpu_cpuid(uint32_t leaf, uint32_t subleaf,
+                             uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    asm volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(subleaf));
+}
+
+static inline uint64_t cpu_read_msr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void cpu_write_msr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" :: "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+#define MSR_EFER        0xC0000080
+#define EFER_NXE        (1ULL << 11)
+#define MSR_PAT         0x277
+#define MSR_APIC_BASE   0x1B
+#define APIC_BASE_X2APIC (1ULL << 10)
+#define APIC_BASE_ENABLE (1ULL << 11)
+
+// CPUID 0x80000001 EDX
+#define CPUID_EXT_NX    (1U << 20)
+#define CPUID_EXT_1GB   (1U << 26)
+
+// CPUID 1 EDX / CPUID 1 ECX / CPUID 7.0 EBX
+#define CPUID_FEAT_APIC (1U << 9)
+#define CPUID_FEAT_PGE  (1U << 13)
+#define CPUID_FEAT_PAT  (1U << 16)
+#define CPUID_FEAT_PCID (1U << 17)
+#define CPUID_FEAT_X2APIC (1U << 21)
+#define CPUID_7_INVPCID (1U << 10)
+
+// ============================================================================
+// Control Registers
+// ============================================================================
+
+#define CR0_NW          (1ULL << 29)
+#define CR0_CD          (1ULL << 30)
+#define CR4_PGE         (1ULL << 7)
+#define CR4_PCIDE       (1ULL << 17)
+
+static inline uint64_t cpu_read_cr0(void) {
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void cpu_write_cr0(uint64_t cr0) {
+    asm volatile("mov %0, %%cr0" :: "r"(cr0) : "memory");
+}
+
+static inline uint64_t cpu_read_cr4(void) {
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void cpu_write_cr4(uint64_t cr4) {
+    asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+// ============================================================================
+// Timestamp Counter
+// ============================================================================
+
+static inline uint64_t cpu_rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// ============================================================================
+// Interrupt Flag
+// ============================================================================
+
+// Disable interrupts and return the previous RFLAGS
+static inline uint64_t cpu_irq_save(void) {
+    uint64_t flags;
+    asm volatile("pushfq\n\tpop %0\n\tcli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+// Restore the interrupt flag saved by cpu_irq_save()
+static inline void cpu_irq_restore(uint64_t flags) {
+    if (flags & 0x200) asm volatile("sti" ::: "memory");
+}
+
+// ============================================================================
+// Spinlock
+// ============================================================================
+
+typedef struct {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spin_lock(spinlock_t* lock) {
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        while (lock->locked) asm volatile("pause");
+    }
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+// Take the lock with interrupts disabled; returns flags for spin_unlock_irqrestore()
+static inline uint64_t spin_lock_irqsave(spinlock_t* lock) {
+    uint64_t flags = cpu_irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint64_t flags) {
+    spin_unlock(lock);
+    cpu_irq_restore(flags);
+}
+
+#endif // CPU_H
@@ -16,9 +16,32 @@ struct gdt_ptr {
     uint64_t base;
 } __attribute__((packed));
 
-struct gdt_entry gdt[5];
+// 64-битный TSS: задачи процессор больше не переключает, остались только
+// стеки — RSP0 для входа из Ring 3 и IST1..7 для отдельных векторов IDT
+struct tss {
+    uint32_t reserved0;
+    uint64_t rsp[3];
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base;
+} __attribute__((packed));
+
+// Записи 5-6 занимает дескриптор TSS: в long mode он двойного размера
+#define GDT_ENTRIES 7
+
+struct gdt_entry gdt[GDT_ENTRIES];
 struct gdt_ptr gp;
 
+static struct tss tss;
+
+// Свой стек для #DF: к двойной ошибке часто приводит испорченный или
+// переполненный стек ядра, и на нём обработчик уже не запустится
+#define IST_STACK_SIZE (16 * 1024)
+__attribute__((aligned(16)))
+static uint8_t double_fault_stack[IST_STACK_SIZE];
+
 // Вспомогательная функция для заполнения одной строчки таблицы
 void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
     gdt[num].base_low    = (base & 0xFFFF);
@@ -30,9 +53,18 @@ void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_
     gdt[num].access      = access;
 }
 
+// Системный дескриптор TSS: младшая половина — обычная запись с типом
+// 0x89 (доступный 64-битный TSS), старшая — биты 32..63 базы
+static void gdt_set_tss(int num, uint64_t base, uint32_t limit) {
+    gdt_set_gate(num, (uint32_t)base, limit, 0x89, 0x00);
+    uint32_t* high = (uint32_t*)&gdt[num + 1];
+    high[0] = (uint32_t)(base >> 32);
+    high[1] = 0;
+}
+
 void gdt_init(void) {
     // Настраиваем указатель: размер таблицы и где она лежит
-    gp.limit = (sizeof(struct gdt_entry) * 5) - 1;
+    gp.limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
     gp.base = (uint64_t)&gdt;
 
     // 0: Null-дескриптор (процессор требует, чтобы первая запись была пустой)
@@ -45,6 +77,10 @@ void gdt_init(void) {
     gdt_set_gate(3, 0, 0, 0xF2, 0x00);
     // 4: Код Пользователя (Ring 3, 64-bit). Флаги: 0xFA
     gdt_set_gate(4, 0, 0, 0xFA, 0x20);
+    // 5-6: TSS. Карты портов ввода-вывода нет: её смещение за пределом TSS
+    tss.ist[IST_DOUBLE_FAULT - 1] = (uint64_t)double_fault_stack + IST_STACK_SIZE;
+    tss.iomap_base = sizeof(struct tss);
+    gdt_set_tss(5, (uint64_t)&tss, sizeof(struct tss) - 1);
 
     // Магия Ассемблера: загружаем новую таблицу и перезагружаем регистры процессора!
     asm volatile(
@@ -64,4 +100,7 @@ void gdt_init(void) {
         : "m"(gp)
         : "rax", "memory"
     );
+
+    // Загружаем TSS: с этого момента процессор берёт из него стеки IST
+    asm volatile("ltr %0" : : "r"((uint16_t)GDT_TSS_SELECTOR));
 }
\ No newline at end of file
@@ -1,5 +1,11 @@
 #pragma once
 #include <stdint.h>
 
+// Селектор дескриптора TSS в GDT
+#define GDT_TSS_SELECTOR 0x28
+
+// Номер стека IST для двойной ошибки (поле ist в шлюзе IDT)
+#define IST_DOUBLE_FAULT 1
+
 // Функция, которая всё настроит и запустит
 void gdt_init(void);
\ No newline at end of file
@@ -1,9 +1,14 @@
 #include "idt.h"
+#include "../paging/vmm/vmm.h"
+#include "../gdt/gdt.h"
+#include "../apic/apic.h"
+#include "../../../kernel/defer.h"
 
 extern void draw_string(void *fb, const char *str, uint32_t x, uint32_t y, uint32_t color);
 extern void halt(void);
 extern void* get_framebuffer(void);
 extern void on_key_pressed(char c);
+extern void xtoa(uint64_t n, char *str);
 
 static inline void outb(uint16_t port, uint8_t val) {
     asm volatile ( "outb %0, %1" : : "a"(val), "Nd"(port) );
@@ -46,29 +51,172 @@ __attribute__((aligned(0x10)))
 static struct idt_entry idt[256];
 static struct idtr idtr;
 
+// Once the APIC is up the EOI is a single MSR or MMIO write instead of a
+// serialising port write to the PIC
+static inline void irq_eoi(void) {
+    if (apic_enabled()) apic_eoi();
+    else outb(0x20, 0x20);
+}
+
 __attribute__((interrupt))
 void default_handler(struct interrupt_frame *frame) {
     (void)frame;
-    outb(0x20, 0x20);
+    irq_eoi();
 }
 
-__attribute__((interrupt)) 
-void isr0_divide_by_zero(struct interrupt_frame *frame) {
+// The local APIC does not set an in-service bit for spurious interrupts,
+// so they must not be acknowledged
+__attribute__((interrupt))
+void spurious_handler(struct interrupt_frame *frame) {
     (void)frame;
+}
+
+// Exceptions 0-31 enter through assembly stubs rather than
+// __attribute__((interrupt)): the panic screen needs every general register,
+// and one common path is simpler when vectors without an error code push a
+// dummy zero. The stubs live here because the build only compiles C files.
+#define EXC_STUB(n)     "exc_stub_" #n ":\n\tpushq $0\n\tpushq $" #n "\n\tjmp exc_common\n"
+#define EXC_STUB_ERR(n) "exc_stub_" #n ":\n\tpushq $" #n "\n\tjmp exc_common\n"
+
+asm(".text\n"
+    EXC_STUB(0)  EXC_STUB(1)  EXC_STUB(2)  EXC_STUB(3)
+    EXC_STUB(4)  EXC_STUB(5)  EXC_STUB(6)  EXC_STUB(7)
+    EXC_STUB_ERR(8)  EXC_STUB(9)  EXC_STUB_ERR(10) EXC_STUB_ERR(11)
+    EXC_STUB_ERR(12) EXC_STUB_ERR(13) EXC_STUB_ERR(14) EXC_STUB(15)
+    EXC_STUB(16) EXC_STUB_ERR(17) EXC_STUB(18) EXC_STUB(19)
+    EXC_STUB(20) EXC_STUB_ERR(21) EXC_STUB(22) EXC_STUB(23)
+    EXC_STUB(24) EXC_STUB(25) EXC_STUB(26) EXC_STUB(27)
+    EXC_STUB(28) EXC_STUB_ERR(29) EXC_STUB_ERR(30) EXC_STUB(31)
+    // Save registers in struct exception_frame order. The CPU aligned RSP to
+    // 16 before pushing its frame, and 22 quadwords keep it aligned for the call.
+    "exc_common:\n\t"
+    "push %rax\n\tpush %rbx\n\tpush %rcx\n\tpush %rdx\n\t"
+    "push %rsi\n\tpush %rdi\n\tpush %rbp\n\tpush %r8\n\t"
+    "push %r9\n\tpush %r10\n\tpush %r11\n\tpush %r12\n\t"
+    "push %r13\n\tpush %r14\n\tpush %r15\n\t"
+    "mov %rsp, %rdi\n\t"
+    "cld\n\t"
+    "call exception_dispatch\n\t"
+    "pop %r15\n\tpop %r14\n\tpop %r13\n\tpop %r12\n\t"
+    "pop %r11\n\tpop %r10\n\tpop %r9\n\tpop %r8\n\t"
+    "pop %rbp\n\tpop %rdi\n\tpop %rsi\n\tpop %rdx\n\t"
+    "pop %rcx\n\tpop %rbx\n\tpop %rax\n\t"
+    "add $16, %rsp\n\t"   // vector and error code
+    "iretq\n"
+    ".section .rodata\n"
+    ".balign 8\n"
+    "exc_stub_table:\n\t"
+    ".quad exc_stub_0,  exc_stub_1,  exc_stub_2,  exc_stub_3\n\t"
+    ".quad exc_stub_4,  exc_stub_5,  exc_stub_6,  exc_stub_7\n\t"
+    ".quad exc_stub_8,  exc_stub_9,  exc_stub_10, exc_stub_11\n\t"
+    ".quad exc_stub_12, exc_stub_13, exc_stub_14, exc_stub_15\n\t"
+    ".quad exc_stub_16, exc_stub_17, exc_stub_18, exc_stub_19\n\t"
+    ".quad exc_stub_20, exc_stub_21, exc_stub_22, exc_stub_23\n\t"
+    ".quad exc_stub_24, exc_stub_25, exc_stub_26, exc_stub_27\n\t"
+    ".quad exc_stub_28, exc_stub_29, exc_stub_30, exc_stub_31\n"
+    ".text\n");
+
+extern void* exc_stub_table[32];
+
+static const char* exception_names[32] = {
+    "DIVIDE ERROR", "DEBUG", "NMI", "BREAKPOINT",
+    "OVERFLOW", "BOUND RANGE EXCEEDED", "INVALID OPCODE", "DEVICE NOT AVAILABLE",
+    "DOUBLE FAULT", "COPROCESSOR SEGMENT OVERRUN", "INVALID TSS", "SEGMENT NOT PRESENT",
+    "STACK SEGMENT FAULT", "GENERAL PROTECTION FAULT", "PAGE FAULT", "RESERVED",
+    "X87 FLOATING POINT", "ALIGNMENT CHECK", "MACHINE CHECK", "SIMD FLOATING POINT",
+    "VIRTUALIZATION", "CONTROL PROTECTION", "RESERVED", "RESERVED",
+    "RESERVED", "RESERVED", "RESERVED", "RESERVED",
+    "HYPERVISOR INJECTION", "VMM COMMUNICATION", "SECURITY", "RESERVED"
+};
+
+static void draw_reg(void *fb, const char *name, uint64_t value, uint32_t x, uint32_t y) {
+    char buf[24];
+    xtoa(value, buf);
+    draw_string(fb, name, x, y, 0x00FFFFFF);
+    draw_string(fb, buf, x + 8 * 7, y, 0x00FFFF00);
+}
+
+static void exception_panic(struct exception_frame *frame) {
     void *fb = get_framebuffer();
-    if (fb) draw_string(fb, "!!! KERNEL PANIC: DIV BY 0 !!!", 10, 300, 0x00FF0000);
+    if (fb) {
+        uint32_t y = 300;
+        draw_string(fb, "!!! KERNEL PANIC: ", 10, y, 0x00FF0000);
+        draw_string(fb, exception_names[frame->vector], 10 + 8 * 18, y, 0x00FF0000);
+
+        uint64_t cr2;
+        asm volatile("mov %%cr2, %0" : "=r"(cr2));
+        const char *names[] = {
+            "VECTOR", "ERROR", "RIP", "CS", "RFLAGS", "RSP", "SS", "CR2",
+            "RAX", "RBX", "RCX", "RDX", "RSI", "RDI", "RBP", "R8",
+            "R9", "R10", "R11", "R12", "R13", "R14", "R15"
+        };
+        uint64_t values[] = {
+            frame->vector, frame->error_code, frame->rip, frame->cs,
+            frame->rflags, frame->rsp, frame->ss, cr2,
+            frame->rax, frame->rbx, frame->rcx, frame->rdx,
+            frame->rsi, frame->rdi, frame->rbp, frame->r8,
+            frame->r9, frame->r10, frame->r11, frame->r12,
+            frame->r13, frame->r14, frame->r15
+        };
+        // Three columns of registers under the title
+        for (int i = 0; i < 23; i++) {
+            draw_reg(fb, names[i], values[i], 10 + (i % 3) * 8 * 28, y + 20 + (i / 3) * 12);
+        }
+    }
     halt();
 }
 
+void exception_dispatch(struct exception_frame *frame) {
+    switch (frame->vector) {
+    case 14:
+        // Resolves demand-paging and copy-on-write faults; panics on its own
+        // for everything else
+        vmm_page_fault_handler(frame->error_code, frame->rip);
+        return;
+    case 1:
+    case 3:
+        // No debugger: single-step and int3 traps resume after the instruction
+        return;
+    default:
+        exception_panic(frame);
+    }
+}
+
+// Scancodes travel from the IRQ handler to keyboard_work() through a
+// single-producer/single-consumer ring: the handler only ever writes head,
+// the consumer only tail, so neither side needs a lock. When the ring is
+// full new scancodes are dropped.
+#define KBD_RING_SIZE 64   // power of two
+
+static uint8_t kbd_ring[KBD_RING_SIZE];
+static uint32_t kbd_head = 0;
+static uint32_t kbd_tail = 0;
+
 __attribute__((interrupt)) 
 void keyboard_handler(struct interrupt_frame *frame) {
     (void)frame;
     uint8_t scancode = inb(0x60);
-    if (!(scancode & 0x80)) {
-        char c = kbd_us[scancode];
-        if (c > 0) on_key_pressed(c);
+    uint32_t head = __atomic_load_n(&kbd_head, __ATOMIC_RELAXED);
+    if (head - __atomic_load_n(&kbd_tail, __ATOMIC_ACQUIRE) < KBD_RING_SIZE) {
+        kbd_ring[head % KBD_RING_SIZE] = scancode;
+        __atomic_store_n(&kbd_head, head + 1, __ATOMIC_RELEASE);
+    }
+    defer_raise(DEFER_KEYBOARD);
+    irq_eoi();
+}
+
+// Runs from the idle loop with interrupts enabled; the shell may take as
+// long as it likes here
+static void keyboard_work(void) {
+    uint32_t tail = __atomic_load_n(&kbd_tail, __ATOMIC_RELAXED);
+    while (tail != __atomic_load_n(&kbd_head, __ATOMIC_ACQUIRE)) {
+        uint8_t scancode = kbd_ring[tail % KBD_RING_SIZE];
+        __atomic_store_n(&kbd_tail, ++tail, __ATOMIC_RELEASE);
+        if (!(scancode & 0x80)) {
+            char c = kbd_us[scancode];
+            if (c > 0) on_key_pressed(c);
+        }
     }
-    outb(0x20, 0x20);
 }
 
 void idt_set_descriptor(uint8_t vector, void *isr, uint8_t flags) {
@@ -87,8 +235,14 @@ void idt_init(void) {
     idtr.base = (uint64_t)&idt[0];
     idtr.limit = (uint16_t)sizeof(struct idt_entry) * 256 - 1;
     for (int i = 0; i < 256; i++) idt_set_descriptor(i, default_handler, 0x8E);
-    idt_set_descriptor(0, isr0_divide_by_zero, 0x8E);
-    idt_set_descriptor(33, keyboard_handler, 0x8E);
+    for (int i = 0; i < 32; i++) idt_set_descriptor(i, exc_stub_table[i], 0x8E);
+    // Breakpoint is a trap gate so int3 keeps interrupts enabled
+    idt_set_descriptor(3, exc_stub_table[3], 0x8F);
+    // #DF switches to its own stack from the TSS
+    idt[8].ist = IST_DOUBLE_FAULT;
+    idt_set_descriptor(IRQ_VECTOR_BASE + 1, keyboard_handler, 0x8E);
+    defer_register(DEFER_KEYBOARD, keyboard_work);
+    idt_set_descriptor(APIC_SPURIOUS_VECTOR, spurious_handler, 0x8E);
     outb(0x20, 0x11); outb(0xA0, 0x11);
     outb(0x21, 0x20); outb(0xA1, 0x28);
     outb(0x21, 0x04); outb(0xA1, 0x02);
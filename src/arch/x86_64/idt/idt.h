@@ -1,4 +1,17 @@
 #pragma once
 #include <stdint.h>
 
+// Registers saved by the exception stubs, lowest address first: general
+// registers, then the vector and error code (0 if the CPU pushes none),
+// then the frame pushed by the CPU
+struct exception_frame {
+    uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+    uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+    uint64_t vector, error_code;
+    uint64_t rip, cs, rflags, rsp, ss;
+};
+
+// Called by the stubs for vectors 0-31
+void exception_dispatch(struct exception_frame *frame);
+
 void idt_init(void);
\ No newline at end of file
@@ -1,7 +1,10 @@
 #include "vmm.h"
 #include "../../../../mm/pmm.h"
 #include "../../../../mm/heap.h"
+#include "../../../../mm/page.h"
+#include "../../../../mm/vma.h"
 #include "../../idt/idt.h"
+#include "../../cpu/cpu.h"
 #include <string.h>
 
 // ============================================================================
@@ -43,6 +46,16 @@ static int int_to_str(int val, char* str) {
 
 static pml4_t* kernel_pml4 = NULL;
 static bool vmm_initialized = false;
+static uint64_t hhdm_off = 0;
+static uint64_t nx_mask = ~PTE_NX;   // NX is stripped until EFER.NXE is on
+static bool gb_pages = false;        // CPU supports 1 GiB leaves
+static uint64_t global_flag = 0;     // PTE_GLOBAL once CR4.PGE is available
+static bool pat_supported = false;   // PAT programmed with a WC entry
+
+_Static_assert(MAX_CPUS * PERCPU_STRIDE <= PERCPU_SIZE, "per-CPU area too small for MAX_CPUS");
+
+// Kernel image bounds from linker.ld
+extern char __kernel_start[], __text_end[], __data_start[], __kernel_end[];
 
 // ============================================================================
 // Inline Assembly
@@ -62,6 +75,118 @@ static inline void invalidate_page(uint64_t addr) {
     asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
 }
 
+static inline void invpcid(uint64_t type, uint64_t pcid, uint64_t addr) {
+    struct { uint64_t pcid; uint64_t addr; } desc = { pcid, addr };
+    asm volatile("invpcid %0, %1" :: "m"(desc), "r"(type) : "memory");
+}
+
+// ============================================================================
+// TLB Contexts (PCID)
+// ============================================================================
+
+// With CR4.PCIDE every TLB entry is tagged with the PCID it was loaded under,
+// so a CR3 write with the no-flush bit keeps the entries of the previous
+// space alive. PCID 0 is the kernel tables; the rest go to user spaces and
+// are recycled least-recently-used.
+
+#define CR3_NOFLUSH     (1ULL << 63)
+#define CR3_PCID_MASK   0xFFFULL
+
+#define INVPCID_ADDRESS 0   // One page in one context
+#define INVPCID_CONTEXT 1   // All non-global entries of one context
+#define INVPCID_ALL     2   // Every context, global entries included
+
+typedef struct {
+    pml4_t* pml4;        // NULL: free
+    uint64_t last_used;
+    bool stale;          // May cache outdated entries: next load flushes
+} pcid_slot_t;
+
+static pcid_slot_t pcid_slots[VMM_PCID_COUNT];
+static uint64_t pcid_clock = 0;
+static bool pcid_enabled = false;
+static bool invpcid_supported = false;
+
+static inline bool is_current(pml4_t* pml4) {
+    return (read_cr3() & PAGE_MASK) == (uint64_t)pml4;
+}
+
+static int pcid_find(pml4_t* pml4) {
+    for (int i = 0; i < VMM_PCID_COUNT; i++) {
+        if (pcid_slots[i].pml4 == pml4) return i;
+    }
+    return -1;
+}
+
+// Takes a free PCID or evicts the least recently used one. The new owner must
+// not see entries left by the previous one, so the slot starts stale.
+static int pcid_assign(pml4_t* pml4) {
+    int victim = -1;
+    uint64_t current = read_cr3() & CR3_PCID_MASK;
+    for (int i = 1; i < VMM_PCID_COUNT; i++) {
+        if (!pcid_slots[i].pml4) {
+            victim = i;
+            break;
+        }
+        if ((uint64_t)i == current) continue;
+        if (victim < 0 || pcid_slots[i].last_used < pcid_slots[victim].last_used) victim = i;
+    }
+    pcid_slots[victim].pml4 = pml4;
+    pcid_slots[victim].stale = true;
+    return victim;
+}
+
+// Invalidation in contexts other than the active one: INVPCID when the CPU
+// has it, otherwise the context is flushed the next time it is loaded
+static void flush_context(int slot, bool single, uint64_t virt) {
+    if (invpcid_supported) {
+        invpcid(single ? INVPCID_ADDRESS : INVPCID_CONTEXT, slot, virt);
+    } else {
+        pcid_slots[slot].stale = true;
+    }
+}
+
+// Kernel-half translations are shared by every space and may be cached under
+// any PCID; user-half ones only under the PCID of their own space
+static void flush_other_contexts(pml4_t* pml4, bool single, uint64_t virt) {
+    bool kernel = (virt >> 63) != 0;
+    if (!pcid_enabled || (kernel && global_flag)) return;  // Global: not per-context
+    
+    uint64_t current = read_cr3() & CR3_PCID_MASK;
+    for (int i = 0; i < VMM_PCID_COUNT; i++) {
+        if (!pcid_slots[i].pml4 || (uint64_t)i == current) continue;
+        if (kernel || pcid_slots[i].pml4 == pml4) flush_context(i, single, virt);
+    }
+}
+
+// Drop one page's translation wherever it may be cached
+static void tlb_flush_page(pml4_t* pml4, uint64_t virt) {
+    if (is_current(pml4) || (virt >> 63)) invalidate_page(virt);
+    flush_other_contexts(pml4, true, virt);
+}
+
+// Drop every non-global translation of a space
+static void tlb_flush_space(pml4_t* pml4) {
+    if (is_current(pml4)) write_cr3(read_cr3());
+    flush_other_contexts(pml4, false, 0);
+}
+
+// Drop everything, global kernel entries included, in every context
+static void tlb_flush_global(void) {
+    if (invpcid_supported) {
+        invpcid(INVPCID_ALL, 0, 0);
+        return;
+    }
+    uint64_t cr4 = cpu_read_cr4();
+    cpu_write_cr4(cr4 & ~CR4_PGE);
+    cpu_write_cr4(cr4);
+}
+
+// Kernel-half leaves are shared by every space and never need a per-CR3 flush
+static inline uint64_t kernel_global(uint64_t virt) {
+    return (virt >> 63) ? global_flag : 0;
+}
+
 // ============================================================================
 // Page Table Helpers
 // ============================================================================
@@ -71,11 +196,17 @@ static inline bool pte_present(uint64_t pte) {
 }
 
 static inline uint64_t pte_get_phys(uint64_t pte) {
-    return pte & PAGE_MASK;
+    return pte & PTE_ADDR_MASK;
 }
 
 static inline void pte_set(uint64_t* pte, uint64_t phys, uint64_t flags) {
-    *pte = phys | flags | PTE_PRESENT;
+    *pte = (phys | flags | PTE_PRESENT) & nx_mask;
+}
+
+// Page tables are reached through the HHDM: frames may live anywhere in RAM,
+// not just in the identity-mapped low 4 GiB
+static inline uint64_t* table_virt(uint64_t phys) {
+    return (uint64_t*)(phys + hhdm_off);
 }
 
 static inline void pte_clear(uint64_t* pte) {
@@ -86,10 +217,26 @@ static inline void pte_clear(uint64_t* pte) {
 // Allocate Page Table
 // ============================================================================
 
+// Tables freed because their last entry went away are all zeroes, so they
+// can be handed out again as they are
+static page_list_t pt_pool = PAGE_LIST_INIT;
+static spinlock_t pt_pool_lock = SPINLOCK_INIT;
+
 void* vmm_alloc_pt(void) {
-    void* page = pmm_alloc_page();
+    uint64_t irq = spin_lock_irqsave(&pt_pool_lock);
+    struct page* recycled = page_list_pop_tail(&pt_pool);
+    spin_unlock_irqrestore(&pt_pool_lock, irq);
+    if (recycled) {
+        recycled->pt_entries = 0;
+        return (void*)page_to_phys(recycled);
+    }
+    
+    // Comes from the PMM's pre-zeroed pool, so no zeroing on this path
+    void* page = pmm_alloc_zeroed_page();
     if (page) {
-        memset(page, 0, PAGE_SIZE);
+        struct page* info = phys_to_page((uint64_t)page);
+        info->owner = PAGE_OWNER_PAGETABLE;
+        info->pt_entries = 0;
     }
     return page;
 }
@@ -100,58 +247,146 @@ void vmm_free_pt(void* pt) {
     }
 }
 
+// Takes back a table whose entries are all zero
+static void pt_recycle(struct page* table) {
+    uint64_t irq = spin_lock_irqsave(&pt_pool_lock);
+    if (pt_pool.count < VMM_PT_POOL_MAX) {
+        page_list_add(&pt_pool, table);
+        table = NULL;
+    }
+    spin_unlock_irqrestore(&pt_pool_lock, irq);
+    if (table) pmm_free_page((void*)page_to_phys(table));
+}
+
 // ============================================================================
-// Get/Create Page Table Entry
+// Table Entry Counts
 // ============================================================================
 
-uint64_t* vmm_get_pte(pml4_t* pml4, uint64_t virt, bool create) {
-    // Calculate indices
-    size_t pml4_idx = PML4_INDEX(virt);
-    size_t pdpt_idx = PDPT_INDEX(virt);
-    size_t pd_idx   = PD_INDEX(virt);
-    size_t pt_idx   = PT_INDEX(virt);
-    
-    // Get PML4 entry
-    if (!pte_present(pml4->entries[pml4_idx])) {
-        if (!create) return NULL;
-        
-        // Allocate PDPT
-        pdpt_t* pdpt = vmm_alloc_pt();
-        if (!pdpt) return NULL;
-        
-        pte_set(&pml4->entries[pml4_idx], (uint64_t)pdpt, PTE_WRITABLE);
+// Every table page counts its present entries in struct page, so an unmap
+// can tell when a table has become empty and give it back
+
+static inline struct page* entry_table(uint64_t* entry) {
+    return phys_to_page(((uint64_t)entry & PAGE_MASK) - hhdm_off);
+}
+
+static inline void entry_added(uint64_t* entry) {
+    entry_table(entry)->pt_entries++;
+}
+
+// Clears path[level] (0 = PML4 entry ... 3 = PT entry) and climbs while the
+// table it sat in becomes empty. Emptied tables are queued on freed and must
+// not be reused before the TLB flush.
+static void clear_entry(uint64_t** path, int level, uint64_t virt, page_list_t* freed) {
+    for (;;) {
+        pte_clear(path[level]);
+        struct page* table = entry_table(path[level]);
+        if (--table->pt_entries || level == 0) return;
+        if (level == 1 && (virt >> 63)) return;  // Kernel PDPTs are shared by every PML4
+        page_list_add(freed, table);
+        level--;
     }
-    
-    pdpt_t* pdpt = (pdpt_t*)pte_get_phys(pml4->entries[pml4_idx]);
-    
-    // Get PDPT entry
-    if (!pte_present(pdpt->entries[pdpt_idx])) {
-        if (!create) return NULL;
-        
-        // Allocate PD
-        pd_t* pd = vmm_alloc_pt();
-        if (!pd) return NULL;
-        
-        pte_set(&pdpt->entries[pdpt_idx], (uint64_t)pd, PTE_WRITABLE);
+}
+
+// ============================================================================
+// Flushing After Table Changes
+// ============================================================================
+
+// Drops every translation, paging-structure caches included, that a change
+// at virt may have left in any context
+static void flush_wide(pml4_t* pml4, uint64_t virt) {
+    if ((virt >> 63) && global_flag) {
+        tlb_flush_global();
+    } else if (virt >> 63) {
+        write_cr3(read_cr3());
+        flush_other_contexts(pml4, false, virt);
+    } else {
+        tlb_flush_space(pml4);
     }
+}
+
+// Flushes a modified range once: invlpg for small batches, a whole-context
+// flush above the threshold
+static void flush_range(pml4_t* pml4, uint64_t virt, uint64_t size) {
+    if (size / PAGE_SIZE > VMM_FLUSH_MAX_PAGES) {
+        flush_wide(pml4, virt);
+        return;
+    }
+    for (uint64_t off = 0; off < size; off += PAGE_SIZE) tlb_flush_page(pml4, virt + off);
+}
+
+// Tables emptied by an unmap are reused only after the flush: until then
+// paging-structure caches may still walk through them
+static void flush_and_release(pml4_t* pml4, uint64_t virt, uint64_t size, page_list_t* freed) {
+    if (!freed->count) {
+        flush_range(pml4, virt, size);
+        return;
+    }
+    flush_wide(pml4, virt);
     
-    pd_t* pd = (pd_t*)pte_get_phys(pdpt->entries[pdpt_idx]);
-    
-    // Get PD entry
-    if (!pte_present(pd->entries[pd_idx])) {
+    struct page* table;
+    while ((table = page_list_pop_tail(freed))) pt_recycle(table);
+}
+
+// ============================================================================
+// Get/Create Page Table Entry
+// ============================================================================
+
+// Returns the table an entry points to, allocating an empty one if asked.
+// user is PTE_USER when the leaf below will be user-accessible: access rights
+// are ANDed across levels, so every table on the path must allow it.
+static uint64_t* next_table(uint64_t* entry, bool create, uint64_t user) {
+    if (!pte_present(*entry)) {
         if (!create) return NULL;
         
-        // Allocate PT
-        pt_t* pt = vmm_alloc_pt();
-        if (!pt) return NULL;
+        void* table = vmm_alloc_pt();
+        if (!table) return NULL;
         
-        pte_set(&pd->entries[pd_idx], (uint64_t)pt, PTE_WRITABLE);
+        pte_set(entry, (uint64_t)table, PTE_WRITABLE | user);
+        entry_added(entry);
     }
+    if (*entry & PTE_HUGE) return NULL;  // Covered by a large page
+    if (create) *entry |= user;
+    return table_virt(pte_get_phys(*entry));
+}
+
+static uint64_t* walk_pte(pml4_t* pml4, uint64_t virt, bool create, uint64_t user) {
+    uint64_t* pdpt = next_table(&table_virt((uint64_t)pml4)[PML4_INDEX(virt)], create, user);
+    if (!pdpt) return NULL;
+    uint64_t* pd = next_table(&pdpt[PDPT_INDEX(virt)], create, user);
+    if (!pd) return NULL;
+    uint64_t* pt = next_table(&pd[PD_INDEX(virt)], create, user);
+    if (!pt) return NULL;
     
-    pt_t* pt = (pt_t*)pte_get_phys(pd->entries[pd_idx]);
+    return &pt[PT_INDEX(virt)];
+}
+
+// Tables created for the user half allow user access; the leaf decides
+uint64_t* vmm_get_pte(pml4_t* pml4, uint64_t virt, bool create) {
+    return walk_pte(pml4, virt, create, (virt >> 63) ? 0 : PTE_USER);
+}
+
+bool vmm_set_pte(uint64_t* pte, uint64_t virt, uint64_t phys, uint64_t flags) {
+    if (pte_present(*pte)) return false;
     
-    // Return PTE
-    return &pt->entries[pt_idx];
+    // Not-present entries are never cached, so there is nothing to flush
+    pte_set(pte, phys & PAGE_MASK, flags | kernel_global(virt));
+    entry_added(pte);
+    return true;
+}
+
+// Lookup-only walk that records the entry used at each level
+static uint64_t* walk_path(pml4_t* pml4, uint64_t virt, uint64_t** path) {
+    path[0] = &table_virt((uint64_t)pml4)[PML4_INDEX(virt)];
+    uint64_t* pdpt = next_table(path[0], false, 0);
+    if (!pdpt) return NULL;
+    path[1] = &pdpt[PDPT_INDEX(virt)];
+    uint64_t* pd = next_table(path[1], false, 0);
+    if (!pd) return NULL;
+    path[2] = &pd[PD_INDEX(virt)];
+    uint64_t* pt = next_table(path[2], false, 0);
+    if (!pt) return NULL;
+    path[3] = &pt[PT_INDEX(virt)];
+    return path[3];
 }
 
 // ============================================================================
@@ -163,8 +398,10 @@ bool vmm_map(pml4_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags) {
     virt = virt & PAGE_MASK;
     phys = phys & PAGE_MASK;
     
+    flags |= kernel_global(virt);
+    
     // Get PTE (create page tables if needed)
-    uint64_t* pte = vmm_get_pte(pml4, virt, true);
+    uint64_t* pte = walk_pte(pml4, virt, true, flags & PTE_USER);
     if (!pte) return false;
     
     // Check if already mapped
@@ -174,6 +411,7 @@ bool vmm_map(pml4_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags) {
     
     // Map it
     pte_set(pte, phys, flags);
+    entry_added(pte);
     invalidate_page(virt);
     
     return true;
@@ -186,13 +424,15 @@ bool vmm_map(pml4_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags) {
 bool vmm_unmap(pml4_t* pml4, uint64_t virt) {
     virt = virt & PAGE_MASK;
     
-    uint64_t* pte = vmm_get_pte(pml4, virt, false);
+    uint64_t* path[4];
+    uint64_t* pte = walk_path(pml4, virt, path);
     if (!pte || !pte_present(*pte)) {
         return false;
     }
     
-    pte_clear(pte);
-    invalidate_page(virt);
+    page_list_t freed = PAGE_LIST_INIT;
+    clear_entry(path, 3, virt, &freed);
+    flush_and_release(pml4, virt, PAGE_SIZE, &freed);
     
     return true;
 }
@@ -206,14 +446,241 @@ bool vmm_is_mapped(pml4_t* pml4, uint64_t virt) {
     return pte && pte_present(*pte);
 }
 
+// ============================================================================
+// Range Operations
+// ============================================================================
+
+#define SIZE_2M 0x200000ULL
+#define SIZE_1G 0x40000000ULL
+
+// Bits vmm_protect_range() may change; address and caching bits are kept
+#define PTE_PROT_MASK (PTE_WRITABLE | PTE_USER | PTE_NX)
+
+// Replaces a huge leaf with a table of next-level leaves mapping the same
+// memory. level_size is the size of the leaf being split (1 GiB or 2 MiB).
+static uint64_t* split_huge(uint64_t* entry, uint64_t level_size) {
+    void* table = vmm_alloc_pt();
+    if (!table) return NULL;
+    
+    uint64_t* t = table_virt((uint64_t)table);
+    uint64_t base = *entry & PTE_ADDR_MASK & ~(level_size - 1);
+    uint64_t attrs = *entry & ~PTE_ADDR_MASK;
+    uint64_t step = level_size / 512;
+    bool pat = (*entry & PTE_PAT_HUGE) != 0;  // Sits inside the address mask
+    if (step == PAGE_SIZE) {
+        attrs &= ~PTE_HUGE;  // 4K entries have no PS bit; bit 7 is PAT there
+        if (pat) attrs |= PTE_PAT;
+    } else if (pat) {
+        attrs |= PTE_PAT_HUGE;
+    }
+    
+    for (size_t i = 0; i < 512; i++) t[i] = (base + i * step) | attrs;
+    phys_to_page((uint64_t)table)->pt_entries = 512;
+    
+    *entry = (uint64_t)table | PTE_PRESENT | PTE_WRITABLE | (attrs & PTE_USER);
+    return t;
+}
+
+// Unmaps (unmap = true) or reprotects every present leaf in the range,
+// splitting huge leaves that are only partly covered
+// Unmap empties leaves through clear_entry(), queueing tables that become
+// empty on freed.
+static bool change_range(pml4_t* pml4, uint64_t virt, uint64_t size, bool unmap, uint64_t flags,
+                         page_list_t* freed) {
+    uint64_t* root = table_virt((uint64_t)pml4);
+    uint64_t* path[4];
+    uint64_t va = virt;
+    uint64_t left = size;
+    
+    while (left) {
+        uint64_t step = (1ULL << 39) - (va & ((1ULL << 39) - 1));
+        path[0] = &root[PML4_INDEX(va)];
+        uint64_t* pdpt = next_table(path[0], false, 0);
+        if (pdpt) {
+            uint64_t* e = path[1] = &pdpt[PDPT_INDEX(va)];
+            step = SIZE_1G - (va & (SIZE_1G - 1));
+            if (pte_present(*e) && (*e & PTE_HUGE) && (step < SIZE_1G || left < SIZE_1G)) {
+                if (!split_huge(e, SIZE_1G)) return false;
+            }
+            if (pte_present(*e) && (*e & PTE_HUGE)) {
+                if (unmap) clear_entry(path, 1, va, freed);
+                else *e = ((*e & ~PTE_PROT_MASK) | (flags & PTE_PROT_MASK)) & nx_mask;
+            } else if (pte_present(*e)) {
+                uint64_t* pd = table_virt(pte_get_phys(*e));
+                e = path[2] = &pd[PD_INDEX(va)];
+                step = SIZE_2M - (va & (SIZE_2M - 1));
+                if (pte_present(*e) && (*e & PTE_HUGE) && (step < SIZE_2M || left < SIZE_2M)) {
+                    if (!split_huge(e, SIZE_2M)) return false;
+                }
+                if (pte_present(*e) && (*e & PTE_HUGE)) {
+                    if (unmap) clear_entry(path, 2, va, freed);
+                    else *e = ((*e & ~PTE_PROT_MASK) | (flags & PTE_PROT_MASK)) & nx_mask;
+                } else if (pte_present(*e)) {
+                    // Walk the rest of this leaf table without going back to the
+                    // root. A table emptied on the way stays readable (all zero)
+                    // until it is released after the flush.
+                    uint64_t* pt = table_virt(pte_get_phys(*e));
+                    for (size_t i = PT_INDEX(va); i < 512 && step && left; i++) {
+                        if (pte_present(pt[i])) {
+                            path[3] = &pt[i];
+                            if (unmap) clear_entry(path, 3, va, freed);
+                            else pt[i] = ((pt[i] & ~PTE_PROT_MASK) | (flags & PTE_PROT_MASK)) & nx_mask;
+                        }
+                        va += PAGE_SIZE;
+                        left -= PAGE_SIZE;
+                        step -= PAGE_SIZE;
+                    }
+                    continue;
+                }
+            }
+        }
+        if (step >= left) break;
+        va += step;
+        left -= step;
+    }
+    return true;
+}
+
+bool vmm_map_range(pml4_t* pml4, uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags) {
+    virt &= PAGE_MASK;
+    phys &= PAGE_MASK;
+    size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+    flags |= kernel_global(virt);
+    
+    // flags are in 4K-leaf form; in a huge leaf PAT moves to bit 12
+    uint64_t huge_flags = (flags & PTE_PAT) ? (flags & ~PTE_PAT) | PTE_PAT_HUGE : flags;
+    
+    uint64_t* root = table_virt((uint64_t)pml4);
+    uint64_t done = 0;
+    
+    while (done < size) {
+        uint64_t va = virt + done;
+        uint64_t pa = phys + done;
+        uint64_t left = size - done;
+        
+        uint64_t* pdpt = next_table(&root[PML4_INDEX(va)], true, flags & PTE_USER);
+        if (!pdpt) goto fail;
+        uint64_t* e = &pdpt[PDPT_INDEX(va)];
+        
+        // Largest leaf that alignment and the remaining length allow
+        if (gb_pages && !((va | pa) & (SIZE_1G - 1)) && left >= SIZE_1G) {
+            if (pte_present(*e)) goto fail;
+            pte_set(e, pa, huge_flags | PTE_HUGE);
+            entry_added(e);
+            done += SIZE_1G;
+            continue;
+        }
+        
+        uint64_t* pd = next_table(e, true, flags & PTE_USER);
+        if (!pd) goto fail;
+        e = &pd[PD_INDEX(va)];
+        
+        if (!((va | pa) & (SIZE_2M - 1)) && left >= SIZE_2M) {
+            if (pte_present(*e)) goto fail;
+            pte_set(e, pa, huge_flags | PTE_HUGE);
+            entry_added(e);
+            done += SIZE_2M;
+            continue;
+        }
+        
+        uint64_t* pt = next_table(e, true, flags & PTE_USER);
+        if (!pt) goto fail;
+        
+        // Fill the rest of this leaf table in one go
+        size_t first = PT_INDEX(va), i;
+        for (i = first; i < 512 && done < size; i++) {
+            if (pte_present(pt[i])) break;
+            pte_set(&pt[i], phys + done, flags);
+            done += PAGE_SIZE;
+        }
+        entry_table(pt)->pt_entries += i - first;
+        if (i < 512 && done < size) goto fail;
+    }
+    
+    // Only not-present entries were filled, and those are never cached in
+    // the TLB, so a fresh mapping needs no flush
+    return true;
+    
+fail:
+    if (done) vmm_unmap_range(pml4, virt, done);
+    return false;
+}
+
+bool vmm_unmap_range(pml4_t* pml4, uint64_t virt, uint64_t size) {
+    virt &= PAGE_MASK;
+    size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+    
+    page_list_t freed = PAGE_LIST_INIT;
+    bool ok = change_range(pml4, virt, size, true, 0, &freed);
+    flush_and_release(pml4, virt, size, &freed);
+    return ok;
+}
+
+bool vmm_protect_range(pml4_t* pml4, uint64_t virt, uint64_t size, uint64_t flags) {
+    virt &= PAGE_MASK;
+    size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+    
+    bool ok = change_range(pml4, virt, size, false, flags, NULL);
+    flush_range(pml4, virt, size);
+    return ok;
+}
+
+// ============================================================================
+// Device Memory (PAT)
+// ============================================================================
+
+// PAT entries 0-3 keep their power-on types, so PWT/PCD alone mean what they
+// always did; entry 4 (PAT bit alone) becomes write-combining
+#define PAT_UC  0x00ULL
+#define PAT_WC  0x01ULL
+#define PAT_WT  0x04ULL
+#define PAT_WB  0x06ULL
+#define PAT_UCM 0x07ULL   // UC-: uncached unless an MTRR says WC
+
+#define PAT_VALUE (PAT_WB | PAT_WT << 8 | PAT_UCM << 16 | PAT_UC << 24 | \
+                   PAT_WC << 32 | PAT_WT << 40 | PAT_UCM << 48 | PAT_UC << 56)
+
+static uint64_t mmio_next = MMIO_START;
+static spinlock_t mmio_lock = SPINLOCK_INIT;
+
+static uint64_t cache_flags(vmm_cache_t cache) {
+    switch (cache) {
+        case VMM_CACHE_WT: return PTE_WRITE_THROUGH;
+        case VMM_CACHE_UC: return PTE_NO_CACHE | PTE_WRITE_THROUGH;
+        // Without PAT there is no WC; uncached is slow but still correct
+        case VMM_CACHE_WC: return pat_supported ? PTE_PAT : PTE_NO_CACHE | PTE_WRITE_THROUGH;
+        default:           return 0;
+    }
+}
+
+void* vmm_map_mmio(uint64_t phys, uint64_t size, vmm_cache_t cache) {
+    uint64_t offset = phys & (PAGE_SIZE - 1);
+    uint64_t base = phys - offset;
+    size = (size + offset + PAGE_SIZE - 1) & PAGE_MASK;
+    
+    // Same offset within 2 MiB as the physical range, so large BARs and
+    // framebuffers get 2 MiB leaves; mappings are permanent, a bump is enough
+    uint64_t irq = spin_lock_irqsave(&mmio_lock);
+    uint64_t virt = ((mmio_next + SIZE_2M - 1) & ~(SIZE_2M - 1)) + (base & (SIZE_2M - 1));
+    if (virt > MMIO_END || MMIO_END - virt < size) {
+        spin_unlock_irqrestore(&mmio_lock, irq);
+        return NULL;
+    }
+    mmio_next = virt + size;
+    spin_unlock_irqrestore(&mmio_lock, irq);
+    
+    if (!vmm_map_range(kernel_pml4, virt, base, size, PTE_WRITABLE | PTE_NX | cache_flags(cache))) {
+        return NULL;
+    }
+    return (void*)(virt + offset);
+}
+
 // ============================================================================
 // Identity Map (for early boot - map physical = virtual)
 // ============================================================================
 
 void vmm_identity_map(uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags) {
-    for (uint64_t addr = 0; addr < size; addr += PAGE_SIZE) {
-        vmm_map(kernel_pml4, virt + addr, phys + addr, flags);
-    }
+    vmm_map_range(kernel_pml4, virt, phys, size, flags);
 }
 
 // ============================================================================
@@ -224,17 +691,182 @@ pml4_t* vmm_create_address_space(void) {
     pml4_t* pml4 = vmm_alloc_pt();
     if (!pml4) return NULL;
     
-    memset(pml4, 0, sizeof(pml4_t));
+    return pml4;
+}
+
+// ============================================================================
+// Copy-on-Write Cloning
+// ============================================================================
+
+#define PML4_USER_ENTRIES 256   // Lower half; the upper half is the kernel's
+
+static inline void copy_page(void* dst, const void* src) {
+    uint64_t count = PAGE_SIZE / 8;
+    asm volatile("rep movsq" : "+D"(dst), "+S"(src), "+c"(count) :: "memory");
+}
+
+// Only anonymous frames are shared copy-on-write: everything else mapped
+// into user space (device memory, kernel-owned buffers) has its lifetime
+// managed elsewhere and stays shared as-is
+static struct page* cow_page(uint64_t pte) {
+    struct page* page = phys_to_page(pte_get_phys(pte));
+    if (!page || (page->flags & PG_RESERVED) || page->owner != PAGE_OWNER_ANON) return NULL;
+    return page;
+}
+
+// Frees the tables below entry and drops the references held by its leaves.
+// Entries are zeroed on the way, so the tables can go to the recycle pool.
+static void free_table(uint64_t entry, int level) {
+    uint64_t* table = table_virt(pte_get_phys(entry));
+    for (int i = 0; i < 512; i++) {
+        uint64_t e = table[i];
+        if (!pte_present(e)) continue;
+        if (level > 1 && !(e & PTE_HUGE)) {
+            free_table(e, level - 1);
+        } else if (level == 1) {
+            struct page* page = cow_page(e);
+            if (page) page_put(page);
+        }
+        table[i] = 0;
+    }
+    pt_recycle(phys_to_page(pte_get_phys(entry)));
+}
+
+// Copies one level of user tables. Writable anonymous leaves lose their
+// WRITABLE bit on both sides and gain PTE_COW; every shared frame takes a
+// reference. Huge leaves are never anonymous and are copied as they are.
+static bool clone_table(uint64_t* dst_entry, uint64_t* src_entry, int level) {
+    uint64_t* dst = vmm_alloc_pt();
+    if (!dst) return false;
+    *dst_entry = (uint64_t)dst | (*src_entry & ~PTE_ADDR_MASK);
+    
+    uint64_t* src = table_virt(pte_get_phys(*src_entry));
+    dst = table_virt((uint64_t)dst);
+    for (int i = 0; i < 512; i++) {
+        uint64_t e = src[i];
+        if (!pte_present(e)) continue;
+        
+        if (level > 1 && !(e & PTE_HUGE)) {
+            if (!clone_table(&dst[i], &src[i], level - 1)) return false;
+            entry_added(&dst[i]);
+            continue;
+        }
+        if (level == 1) {
+            struct page* page = cow_page(e);
+            if (page) {
+                if (e & PTE_WRITABLE) {
+                    e = (e & ~PTE_WRITABLE) | PTE_COW;
+                    src[i] = e;
+                }
+                page_get(page);
+            }
+        }
+        dst[i] = e;
+        entry_added(&dst[i]);
+    }
+    return true;
+}
+
+pml4_t* vmm_clone_address_space(pml4_t* src) {
+    pml4_t* pml4 = vmm_alloc_pt();
+    if (!pml4) return NULL;
+    
+    uint64_t* dst_entries = table_virt((uint64_t)pml4);
+    uint64_t* src_entries = table_virt((uint64_t)src);
+    
+    // Kernel half: the PDPTs themselves are shared, so later kernel mappings
+    // show up in every address space
+    for (int i = PML4_USER_ENTRIES; i < 512; i++) {
+        dst_entries[i] = src_entries[i];
+        if (pte_present(dst_entries[i])) entry_added(&dst_entries[i]);
+    }
+    
+    bool ok = true;
+    for (int i = 0; i < PML4_USER_ENTRIES && ok; i++) {
+        if (pte_present(src_entries[i])) {
+            ok = clone_table(&dst_entries[i], &src_entries[i], 3);
+            entry_added(&dst_entries[i]);
+        }
+    }
+    
+    // Source leaves were write-protected; stale writable TLB entries must go
+    tlb_flush_space(src);
     
+    if (!ok) {
+        vmm_destroy_address_space(pml4);
+        return NULL;
+    }
     return pml4;
 }
 
+void vmm_destroy_address_space(pml4_t* pml4) {
+    int slot = pcid_find(pml4);
+    if (slot > 0) pcid_slots[slot].pml4 = NULL;
+    
+    uint64_t* entries = table_virt((uint64_t)pml4);
+    for (int i = 0; i < PML4_USER_ENTRIES; i++) {
+        if (pte_present(entries[i])) free_table(entries[i], 3);
+    }
+    vmm_free_pt(pml4);
+}
+
+bool vmm_cow_fault(pml4_t* pml4, uint64_t virt) {
+    virt &= PAGE_MASK;
+    uint64_t* pte = vmm_get_pte(pml4, virt, false);
+    if (!pte || !pte_present(*pte) || !(*pte & PTE_COW)) return false;
+    
+    uint64_t old = *pte;
+    struct page* page = phys_to_page(pte_get_phys(old));
+    uint64_t flags = (old & ~(PTE_ADDR_MASK | PTE_COW | PTE_ACCESSED | PTE_DIRTY)) | PTE_WRITABLE;
+    
+    // Last reference: the frame is already private, just make it writable
+    if (__atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) == 1) {
+        *pte = pte_get_phys(old) | flags;
+        tlb_flush_page(pml4, virt);
+        return true;
+    }
+    
+    void* frame = pmm_alloc_page();
+    if (!frame) return false;
+    phys_to_page((uint64_t)frame)->owner = PAGE_OWNER_ANON;
+    copy_page(table_virt((uint64_t)frame), table_virt(pte_get_phys(old)));
+    
+    *pte = (uint64_t)frame | flags;
+    tlb_flush_page(pml4, virt);
+    page_put(page);
+    return true;
+}
+
+// ============================================================================
+// Kernel Address Space
+// ============================================================================
+
+pml4_t* vmm_get_kernel_pml4(void) {
+    return kernel_pml4;
+}
+
 // ============================================================================
 // Switch Address Space
 // ============================================================================
 
 void vmm_switch(pml4_t* pml4) {
-    write_cr3((uint64_t)pml4);
+    if (!pcid_enabled) {
+        write_cr3((uint64_t)pml4);
+        return;
+    }
+    
+    int slot = pcid_find(pml4);
+    if (slot < 0) slot = pcid_assign(pml4);
+    pcid_slots[slot].last_used = ++pcid_clock;
+    
+    // Entries tagged with this PCID are still valid unless marked otherwise
+    uint64_t cr3 = (uint64_t)pml4 | (uint64_t)slot;
+    if (pcid_slots[slot].stale) {
+        pcid_slots[slot].stale = false;
+    } else {
+        cr3 |= CR3_NOFLUSH;
+    }
+    write_cr3(cr3);
 }
 
 // ============================================================================
@@ -273,44 +905,192 @@ void vmm_page_fault_handler(uint64_t error_code, uint64_t rip) {
     uint64_t fault_addr;
     asm volatile("mov %%cr2, %0" : "=r"(fault_addr));
     
-    void* fb = get_framebuffer();
-    
-    // Check if it's a present page (protection fault) vs missing page
-    bool present = (error_code & 0x01) != 0;
-    bool write = (error_code & 0x02) != 0;
-    bool user = (error_code & 0x04) != 0;
+    // Lazily backed regions get their page here and the access is retried
+    if (vma_handle_fault(fault_addr, error_code)) return;
     
-    // For now, just halt on page fault
+    void* fb = get_framebuffer();
     if (fb) {
-        draw_string(fb, "PAGE FAULT!", 10, 400, 0x00FF0000);
+        char buf[32];
+        draw_string(fb, "PAGE FAULT! addr 0x", 10, 400, 0x00FF0000);
+        hex_to_str(fault_addr, buf);
+        draw_string(fb, buf, 10 + 8 * 19, 400, 0x00FF0000);
+        draw_string(fb, "rip 0x", 10, 415, 0x00FF0000);
+        hex_to_str(rip, buf);
+        draw_string(fb, buf, 10 + 8 * 6, 415, 0x00FF0000);
+        draw_string(fb, "err ", 10, 430, 0x00FF0000);
+        int_to_str((int)error_code, buf);
+        draw_string(fb, buf, 10 + 8 * 4, 430, 0x00FF0000);
     }
     
     // Hang
-    for(;;) asm("hlt");
+    for(;;) asm("cli; hlt");
+}
+
+// ============================================================================
+// Direct Map and Kernel Image
+// ============================================================================
+
+// Maps the kernel image: text RX, rodata R, data/bss RW
+static bool map_kernel(uint64_t kernel_phys) {
+    uint64_t start = (uint64_t)__kernel_start;
+    uint64_t text_end = ((uint64_t)__text_end + PAGE_SIZE - 1) & PAGE_MASK;
+    uint64_t data_start = (uint64_t)__data_start;
+    uint64_t end = ((uint64_t)__kernel_end + PAGE_SIZE - 1) & PAGE_MASK;
+    
+    return vmm_map_range(kernel_pml4, start, kernel_phys, text_end - start, 0) &&
+           vmm_map_range(kernel_pml4, text_end, kernel_phys + (text_end - start),
+                         data_start - text_end, PTE_NX) &&
+           vmm_map_range(kernel_pml4, data_start, kernel_phys + (data_start - start),
+                         end - data_start, PTE_WRITABLE | PTE_NX);
+}
+
+// Cloned PML4s share the kernel-half PDPTs by reference, so a PML4 entry
+// added later would be missing from spaces cloned before it. The windows
+// filled at run time get all their PDPTs up front.
+static bool prealloc_kernel_pdpts(void) {
+    static const uint64_t windows[][2] = {
+        { VMALLOC_START, VMALLOC_END },
+        { PERCPU_START, PERCPU_END },
+        { MMIO_START, MMIO_END },
+        { MODULES_START, MODULES_END },
+    };
+    uint64_t* root = table_virt((uint64_t)kernel_pml4);
+    
+    for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+        for (uint64_t i = PML4_INDEX(windows[w][0]); i <= PML4_INDEX(windows[w][1] - 1); i++) {
+            if (!next_table(&root[i], true, 0)) return false;
+        }
+    }
+    return true;
+}
+
+// Maps the memory map into the direct map. Only ranges the firmware reports
+// go in, so MMIO holes never get a WB alias next to their vmm_map_mmio
+// mapping; RAM and ACPI memory are WB, reserved ranges (firmware tables,
+// sometimes device registers) UC, and the framebuffer stays out entirely.
+static bool map_direct(void) {
+    uint64_t count;
+    const struct limine_memmap_entry* memmap = pmm_get_memmap(&count);
+    uint64_t mapped_end = 0;
+    
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t flags = PTE_WRITABLE | PTE_NX;
+        switch (memmap[i].type) {
+            case LIMINE_MEMMAP_USABLE:
+            case LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE:
+            case LIMINE_MEMMAP_ACPI_RECLAIMABLE:
+            case LIMINE_MEMMAP_ACPI_NVS:
+            case LIMINE_MEMMAP_KERNEL_AND_MODULES:
+                break;
+            case LIMINE_MEMMAP_FRAMEBUFFER:
+            case LIMINE_MEMMAP_BAD_MEMORY:
+                continue;
+            default:
+                flags |= cache_flags(VMM_CACHE_UC);
+                break;
+        }
+        
+        // Only RAM entries are page-aligned; the map is sorted, so a page
+        // shared by two entries goes to the first one
+        uint64_t start = memmap[i].base & PAGE_MASK;
+        uint64_t end = (memmap[i].base + memmap[i].length + PAGE_SIZE - 1) & PAGE_MASK;
+        if (start < mapped_end) start = mapped_end;
+        if (start >= end) continue;
+        
+        if (!vmm_map_range(kernel_pml4, hhdm_off + start, start, end - start, flags)) return false;
+        mapped_end = end;
+    }
+    return true;
+}
+
+// SDM sequence for changing memory types: with caching disabled, write back
+// and drop both caches and the TLB on either side of the PAT write, so no
+// line or translation of the old types survives
+static void program_pat(void) {
+    uint64_t irq = cpu_irq_save();
+    uint64_t cr0 = cpu_read_cr0();
+    uint64_t cr4 = cpu_read_cr4();
+    
+    cpu_write_cr0((cr0 | CR0_CD) & ~CR0_NW);
+    asm volatile("wbinvd" ::: "memory");
+    // Clearing PGE flushes global entries too; without PGE a CR3 load is enough
+    if (cr4 & CR4_PGE) cpu_write_cr4(cr4 & ~CR4_PGE);
+    else write_cr3(read_cr3());
+    
+    cpu_write_msr(MSR_PAT, PAT_VALUE);
+    
+    asm volatile("wbinvd" ::: "memory");
+    if (cr4 & CR4_PGE) cpu_write_cr4(cr4);
+    else write_cr3(read_cr3());
+    cpu_write_cr0(cr0);
+    cpu_irq_restore(irq);
 }
 
 // ============================================================================
 // VMM Initialization
 // ============================================================================
 
-void vmm_init(void) {
+void vmm_init(uint64_t hhdm_offset, uint64_t phys_limit, uint64_t kernel_phys) {
     if (vmm_initialized) return;
     
-    // Get the current page tables from Limine (already set up)
-    // We don't create new ones - we use what bootloader gave us
-    // and just add additional kernel mappings
+    hhdm_off = hhdm_offset;
     
-    uint64_t current_cr3 = read_cr3();
-    kernel_pml4 = (pml4_t*)current_cr3;
+    uint32_t a, b, c, d;
+    cpu_cpuid(0x80000000, 0, &a, &b, &c, &d);
+    uint32_t ext = 0;
+    if (a >= 0x80000001) cpu_cpuid(0x80000001, 0, &a, &b, &c, &ext);
     
-    // For now, we just enable paging using bootloader's tables
-    // The identity mapping is already set up by Limine
+    if (ext & CPUID_EXT_NX) {
+        cpu_write_msr(MSR_EFER, cpu_read_msr(MSR_EFER) | EFER_NXE);
+        nx_mask = ~0ULL;
+    }
     
-    // Enable paging - CR0.PG bit
-    uint64_t cr0;
-    asm volatile("mov %%cr0, %0" : "=r"(cr0));
-    cr0 |= 0x80000000; // PG bit
-    asm volatile("mov %0, %%cr0" :: "r"(cr0));
+    gb_pages = (ext & CPUID_EXT_1GB) != 0;
+    
+    uint32_t feat_ecx, feat_edx;
+    cpu_cpuid(1, 0, &a, &b, &feat_ecx, &feat_edx);
+    
+    // G bits are ignored until CR4.PGE is set, so they can go in right away
+    if (feat_edx & CPUID_FEAT_PGE) global_flag = PTE_GLOBAL;
+    
+    if (feat_edx & CPUID_FEAT_PAT) {
+        program_pat();
+        pat_supported = true;
+    }
+    
+    // The HHDM must stay inside the direct-map window of the layout
+    if (hhdm_off < DIRECT_MAP_START || phys_limit > DIRECT_MAP_END - hhdm_off) {
+        for (;;) asm("cli; hlt");
+    }
+    
+    // Build our own hierarchy; Limine's tables (and its identity map of the
+    // low 4 GiB) stop being used once CR3 is switched
+    kernel_pml4 = vmm_create_address_space();
+    if (!kernel_pml4 || !map_direct() || !map_kernel(kernel_phys) || !prealloc_kernel_pdpts()) {
+        for (;;) asm("cli; hlt");
+    }
+    
+    write_cr3((uint64_t)kernel_pml4);
+    
+    // Toggling PGE also drops any global entries left from Limine's tables
+    if (global_flag) {
+        uint64_t cr4 = cpu_read_cr4();
+        cpu_write_cr4(cr4 & ~CR4_PGE);
+        cpu_write_cr4(cr4 | CR4_PGE);
+    }
+    
+    // PCIDE may only be set while CR3 selects PCID 0, which it now does
+    if (feat_ecx & CPUID_FEAT_PCID) {
+        cpu_write_cr4(cpu_read_cr4() | CR4_PCIDE);
+        pcid_slots[0].pml4 = kernel_pml4;
+        pcid_enabled = true;
+        
+        cpu_cpuid(0, 0, &a, &b, &c, &d);
+        if (a >= 7) {
+            cpu_cpuid(7, 0, &a, &b, &c, &d);
+            invpcid_supported = (b & CPUID_7_INVPCID) != 0;
+        }
+    }
     
     vmm_initialized = true;
 }
@@ -2,6 +2,7 @@
 #define VMM_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 
 // ============================================================================
@@ -11,6 +12,7 @@
 #define PAGE_SHIFT      12
 #define PAGE_SIZE       4096
 #define PAGE_MASK       0xFFFFFFFFFFFFF000
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL  // Physical address bits of an entry
 
 #define PML4_INDEX(vaddr) (((vaddr) >> 39) & 0x1FF)
 #define PDPT_INDEX(vaddr) (((vaddr) >> 30) & 0x1FF)
@@ -29,11 +31,57 @@
 #define PTE_ACCESSED   0x020   // Accessed
 #define PTE_DIRTY      0x040   // Dirty (for PTEs)
 #define PTE_HUGE       0x080   // Huge page (1GB/2MB)
+#define PTE_PAT        0x080   // PAT index bit of a 4K leaf (PS position)
+#define PTE_PAT_HUGE   0x1000  // PAT index bit of a 2MB/1GB leaf
 #define PTE_GLOBAL     0x100   // Global (not flushed on CR3 write)
+#define PTE_COW        0x200   // Software bit: read-only share, copy on write
+#define PTE_NX         (1ULL << 63) // No execute
 
-// Kernel virtual address space
-#define KERNEL_VMA      0xFFFF800000000000ULL
-#define KERNEL_SIZE     0x40000000ULL  // 1GB for kernel
+// ============================================================================
+// Kernel Address Space Layout
+// ============================================================================
+//
+//   0x0000000000000000 - 0x00007FFFFFFFFFFF   user space, per address space
+//   0xFFFF800000000000 - 0xFFFFBFFFFFFFFFFF   direct map of physical memory
+//   0xFFFFC00000000000 - 0xFFFFC0FFFFFFFFFF   vmalloc
+//   0xFFFFC10000000000 - 0xFFFFC1003FFFFFFF   per-CPU areas
+//   0xFFFFC20000000000 - 0xFFFFC2FFFFFFFFFF   MMIO window
+//   0xFFFFFFFF80000000 - 0xFFFFFFFF9FFFFFFF   kernel image (linker.ld)
+//   0xFFFFFFFFA0000000 - 0xFFFFFFFFFEFFFFFF   modules
+//
+// The direct map sits at Limine's HHDM offset; vmm_init checks that the
+// offset and the amount of RAM keep it inside its window. Everything in the
+// upper half is mapped global, so kernel TLB entries survive CR3 switches.
+
+#define USER_END           0x0000800000000000ULL
+
+#define DIRECT_MAP_START   0xFFFF800000000000ULL
+#define DIRECT_MAP_SIZE    0x0000400000000000ULL  // 64 TiB
+#define DIRECT_MAP_END     (DIRECT_MAP_START + DIRECT_MAP_SIZE)
+
+// vmalloc area: virtually contiguous kernel memory backed by arbitrary frames
+#define VMALLOC_START      0xFFFFC00000000000ULL
+#define VMALLOC_SIZE       0x0000010000000000ULL  // 1 TiB
+#define VMALLOC_END        (VMALLOC_START + VMALLOC_SIZE)
+
+// One fixed-size slot per CPU, so a CPU's data is at a known address
+#define PERCPU_START       0xFFFFC10000000000ULL
+#define PERCPU_STRIDE      0x0000000000400000ULL  // 4 MiB per CPU
+#define PERCPU_SIZE        0x0000000040000000ULL  // 1 GiB
+#define PERCPU_END         (PERCPU_START + PERCPU_SIZE)
+
+// Device registers mapped uncached or write-combining
+#define MMIO_START         0xFFFFC20000000000ULL
+#define MMIO_SIZE          0x0000010000000000ULL  // 1 TiB
+#define MMIO_END           (MMIO_START + MMIO_SIZE)
+
+// Kernel image: the top 2 GiB, so -mcmodel=kernel can address it
+#define KERNEL_IMAGE_START 0xFFFFFFFF80000000ULL
+#define KERNEL_IMAGE_SIZE  0x0000000020000000ULL  // 512 MiB
+#define KERNEL_IMAGE_END   (KERNEL_IMAGE_START + KERNEL_IMAGE_SIZE)
+
+#define MODULES_START      KERNEL_IMAGE_END
+#define MODULES_END        0xFFFFFFFFFF000000ULL
 
 // ============================================================================
 // Structures
@@ -59,13 +107,31 @@ typedef struct {
 // VMM Functions
 // ============================================================================
 
-// Initialize virtual memory manager
-void vmm_init(void);
+// Build kernel page tables (HHDM direct map of the memory map entries below
+// phys_limit and the kernel image loaded at kernel_phys) and switch to them.
+// Device memory is not in the direct map: use vmm_map_mmio()
+void vmm_init(uint64_t hhdm_offset, uint64_t phys_limit, uint64_t kernel_phys);
 
 // Create new address space
 pml4_t* vmm_create_address_space(void);
 
-// Switch to different address space
+// Duplicate an address space: kernel half shared by reference, anonymous
+// user pages shared read-only and copied on the first write
+pml4_t* vmm_clone_address_space(pml4_t* src);
+
+// Free the user-half tables and PML4, dropping page references
+void vmm_destroy_address_space(pml4_t* pml4);
+
+// Resolve a write fault on a PTE_COW page; false if the page is not COW
+bool vmm_cow_fault(pml4_t* pml4, uint64_t virt);
+
+// Kernel page tables (physical address of the PML4)
+pml4_t* vmm_get_kernel_pml4(void);
+
+// Switch to different address space. With PCID support each space keeps a
+// tagged TLB context, so switching back to a recently used one skips the flush
+#define VMM_PCID_COUNT 64
+
 void vmm_switch(pml4_t* pml4);
 
 // Map virtual page to physical page
@@ -74,12 +140,38 @@ bool vmm_map(pml4_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags);
 // Unmap virtual page
 bool vmm_unmap(pml4_t* pml4, uint64_t virt);
 
-// Get page table entry (for debugging)
+// Range operations: one table walk per leaf table, 2MB/1GB leaves where
+// alignment allows, one TLB flush per call (CR3 reload above the threshold)
+#define VMM_FLUSH_MAX_PAGES 32
+
+bool vmm_map_range(pml4_t* pml4, uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags);
+bool vmm_unmap_range(pml4_t* pml4, uint64_t virt, uint64_t size);
+
+// Replace the WRITABLE/USER/NX bits of every mapped page in the range
+bool vmm_protect_range(pml4_t* pml4, uint64_t virt, uint64_t size, uint64_t flags);
+
+// Get page table entry, accessed through the HHDM (NULL under a huge page).
+// The entries of one leaf table follow each other, 512 per table
 uint64_t* vmm_get_pte(pml4_t* pml4, uint64_t virt, bool create);
 
+// Fill a not-present entry from vmm_get_pte() mapping virt; false if present
+bool vmm_set_pte(uint64_t* pte, uint64_t virt, uint64_t phys, uint64_t flags);
+
 // Check if virtual address is mapped
 bool vmm_is_mapped(pml4_t* pml4, uint64_t virt);
 
+// Memory types for device mappings, selected through the PAT
+typedef enum {
+    VMM_CACHE_WB,        // Write-back (normal RAM)
+    VMM_CACHE_WT,        // Write-through
+    VMM_CACHE_UC,        // Strongly uncached: device registers
+    VMM_CACHE_WC,        // Write-combining: framebuffers
+} vmm_cache_t;
+
+// Map physical device memory into the MMIO window with the given memory
+// type. Returns the virtual address of phys, or NULL.
+void* vmm_map_mmio(uint64_t phys, uint64_t size, vmm_cache_t cache);
+
 // Identity map region (for early boot)
 void vmm_identity_map(uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags);
 
@@ -89,7 +181,13 @@ void vmm_enable_paging(uint64_t cr3);
 // Get current CR3 value
 uint64_t vmm_get_cr3(void);
 
-// Allocate a page table
+// #PF entry point: resolves demand-paged faults, halts on anything else
+void vmm_page_fault_handler(uint64_t error_code, uint64_t rip);
+
+// Page tables emptied by an unmap are kept for reuse, up to this many
+#define VMM_PT_POOL_MAX 64
+
+// Allocate a page table (from the recycled pool first), zeroed
 void* vmm_alloc_pt(void);
 
 // Free a page table  
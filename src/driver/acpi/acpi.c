@@ -0,0 +1,104 @@
+#include "acpi.h"
+
+// ============================================================================
+// Root Pointers
+// ============================================================================
+
+struct acpi_rsdp {
+    char     signature[8];    // "RSD PTR "
+    uint8_t  checksum;        // covers the first 20 bytes
+    char     oem_id[6];
+    uint8_t  revision;        // 0 = ACPI 1.0 (RSDT only), 2+ = XSDT present
+    uint32_t rsdt_address;
+    // ACPI 2.0+
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t  extended_checksum;
+    uint8_t  reserved[3];
+} __attribute__((packed));
+
+static uint64_t hhdm = 0;
+static const struct acpi_sdt_header* root = NULL;
+static bool root_is_xsdt = false;
+
+static const void* phys_to_virt(uint64_t phys) {
+    return (const void*)(phys + hhdm);
+}
+
+// Every ACPI structure sums to zero over its length
+static bool checksum_ok(const void* data, uint32_t length) {
+    const uint8_t* bytes = data;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++) sum += bytes[i];
+    return sum == 0;
+}
+
+static bool signature_is(const char* a, const char* b, int n) {
+    for (int i = 0; i < n; i++) {
+        if (a[i] != b[i]) return false;
+    }
+    return true;
+}
+
+// ============================================================================
+// Initialization
+// ============================================================================
+
+bool acpi_init(uint64_t rsdp_phys, uint64_t hhdm_offset) {
+    hhdm = hhdm_offset;
+    root = NULL;
+    if (!rsdp_phys) return false;
+    
+    const struct acpi_rsdp* rsdp = phys_to_virt(rsdp_phys);
+    if (!signature_is(rsdp->signature, "RSD PTR ", 8) || !checksum_ok(rsdp, 20)) return false;
+    
+    // Prefer the XSDT: its entries are 64-bit
+    const struct acpi_sdt_header* table;
+    if (rsdp->revision >= 2 && rsdp->xsdt_address &&
+        checksum_ok(rsdp, rsdp->length)) {
+        table = phys_to_virt(rsdp->xsdt_address);
+        root_is_xsdt = true;
+        if (!signature_is(table->signature, "XSDT", 4)) return false;
+    } else {
+        table = phys_to_virt(rsdp->rsdt_address);
+        root_is_xsdt = false;
+        if (!signature_is(table->signature, "RSDT", 4)) return false;
+    }
+    if (!checksum_ok(table, table->length)) return false;
+    
+    root = table;
+    return true;
+}
+
+// The RSDT/XSDT usually sits in ACPI-reclaimable memory too: once that goes
+// to the PMM, walking it would read freed frames
+void acpi_release(void) {
+    root = NULL;
+}
+
+// ============================================================================
+// Table Lookup
+// ============================================================================
+
+const struct acpi_sdt_header* acpi_find_table(const char* signature) {
+    if (!root) return NULL;
+    
+    uint32_t entry_size = root_is_xsdt ? 8 : 4;
+    uint32_t count = (root->length - sizeof(struct acpi_sdt_header)) / entry_size;
+    const uint8_t* entries = (const uint8_t*)(root + 1);
+    
+    for (uint32_t i = 0; i < count; i++) {
+        // Entries are not naturally aligned in the XSDT
+        uint64_t phys = 0;
+        for (uint32_t b = 0; b < entry_size; b++) {
+            phys |= (uint64_t)entries[i * entry_size + b] << (8 * b);
+        }
+        if (!phys) continue;
+        
+        const struct acpi_sdt_header* table = phys_to_virt(phys);
+        if (signature_is(table->signature, signature, 4) && checksum_ok(table, table->length)) {
+            return table;
+        }
+    }
+    return NULL;
+}
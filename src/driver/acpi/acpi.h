@@ -0,0 +1,42 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// ============================================================================
+// ACPI Tables
+// ============================================================================
+
+// Common header of every system description table
+struct acpi_sdt_header {
+    char     signature[4];
+    uint32_t length;          // whole table, header included
+    uint8_t  revision;
+    uint8_t  checksum;
+    char     oem_id[6];
+    char     oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+// ============================================================================
+// ACPI Functions
+// ============================================================================
+
+// Validate the RSDP at physical address rsdp_phys and remember the root table.
+// Tables are read through the direct map at hhdm_offset.
+bool acpi_init(uint64_t rsdp_phys, uint64_t hhdm_offset);
+
+// Find a table by its 4-byte signature (e.g. "APIC" for the MADT).
+// Tables usually sit in ACPI-reclaimable memory: the pointer is only valid
+// until that memory is handed to the PMM, so callers copy what they need.
+const struct acpi_sdt_header* acpi_find_table(const char* signature);
+
+// Forget the root table before ACPI-reclaimable memory is handed to the PMM.
+// acpi_find_table returns NULL from then on.
+void acpi_release(void);
+
+#endif // ACPI_H
@@ -1,5 +1,6 @@
 #include "ahci.h"
 #include "../../mm/pmm.h"
+#include "../../arch/x86_64/paging/vmm/vmm.h"
 #include <string.h>
 
 // ============================================================================
@@ -44,11 +45,15 @@ static int ahci_wait_for(volatile uint32_t* reg, uint32_t mask, uint32_t timeout
 int ahci_init(void* pci_bar) {
     if (ahci_initialized) return 0;
     
-    ahci_base = (ahci_hba_t*)pci_bar;
-    if (!ahci_base) {
+    // pci_bar is the physical ABAR (BAR5); the registers need a strictly
+    // uncached mapping of their own
+    uint64_t abar = (uint64_t)pci_bar;
+    if (!abar) {
         // Use default address if no PCI BAR provided
-        ahci_base = (ahci_hba_t*)0xFE000000;
+        abar = 0xFE000000;
     }
+    ahci_base = (ahci_hba_t*)vmm_map_mmio(abar, AHCI_ABAR_SIZE, VMM_CACHE_UC);
+    if (!ahci_base) return 0;
     
     // Read capabilities
     uint32_t cap = ahci_read_reg(AHCI_CAP);
@@ -128,25 +133,22 @@ int ahci_port_init(int port) {
     // Clear any pending interrupts
     port_base->is = 0xFFFFFFFF;
     
-    // Allocate command list and FIS buffer
-    void* cmd_list = pmm_alloc_page();
-    void* fis_buf = pmm_alloc_page();
+    // Allocate command list and FIS buffer (below 4 GiB unless the HBA supports 64-bit DMA)
+    int zone = (ahci_read_reg(AHCI_CAP) & AHCI_CAP_S64A) ? PMM_ZONE_NORMAL : PMM_ZONE_DMA32;
+    void* cmd_list = pmm_alloc_zeroed_page_zone(zone);
+    void* fis_buf = pmm_alloc_zeroed_page_zone(zone);
     
     if (!cmd_list || !fis_buf) {
         return -1;
     }
     
-    // Clear memory
-    memset(cmd_list, 0, 1024);
-    memset(fis_buf, 0, 256);
-    
     // Set command list base
     port_base->clb = (uint32_t)(uint64_t)cmd_list;
-    port_base->clbu = 0;
+    port_base->clbu = (uint32_t)((uint64_t)cmd_list >> 32);
     
     // Set FIS base
     port_base->fb = (uint32_t)(uint64_t)fis_buf;
-    port_base->fbu = 0;
+    port_base->fbu = (uint32_t)((uint64_t)fis_buf >> 32);
     
     // Enable FIS receive
     cmd = port_base->cmd;
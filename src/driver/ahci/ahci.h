@@ -8,6 +8,7 @@
 // ============================================================================
 
 #define AHCI_BASE_ADDR     0x400000  // Placeholder - will be set by PCI
+#define AHCI_ABAR_SIZE     0x1100    // Generic host control + 32 port register sets
 
 // HBA Registers
 #define AHCI_CAP          0x00  // Host Capabilities
@@ -22,6 +23,9 @@
 #define AHCI_CAP2        0x24  // Host Capabilities Extended
 #define AHCI_BOHC        0x28  // BIOS/OS Handoff
 
+// HBA Capabilities
+#define AHCI_CAP_S64A    (1U << 31)  // Supports 64-bit Addressing
+
 // HBA Global Host Control
 #define AHCI_GHC_AE      (1 << 31)  // AHCI Enable
 #define AHCI_GHC_IE       (1 << 1)   // Interrupt Enable
@@ -160,7 +164,7 @@ typedef struct {
 // AHCI Driver Functions
 // ============================================================================
 
-// Initialize AHCI controller
+// Initialize AHCI controller (pci_bar: physical address of the ABAR)
 int ahci_init(void* pci_bar);
 
 // Check if device is present
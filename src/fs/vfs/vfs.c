@@ -9,6 +9,7 @@
 #define VFS_MAX_FD 32
 
 static vfs_mount_t* mounts = NULL;
+static kmem_cache_t* mount_cache = NULL;
 static vfs_fd_t file_descriptors[VFS_MAX_FD];
 static int vfs_initialized = 0;
 
@@ -25,6 +26,8 @@ void vfs_init(void) {
         file_descriptors[i].refcount = 0;
     }
     
+    mount_cache = kmem_cache_create("vfs_mount", sizeof(vfs_mount_t), KMEM_CACHE_LINE, NULL);
+    
     vfs_initialized = 1;
 }
 
@@ -36,7 +39,7 @@ int vfs_mount(const char* device, const char* mountpoint, void* fs_data,
               int (*read)(void*, uint64_t, uint32_t, void*),
               int (*write)(void*, uint64_t, uint32_t, void*)) {
     
-    vfs_mount_t* mount = kmalloc(sizeof(vfs_mount_t));
+    vfs_mount_t* mount = kmem_cache_alloc(mount_cache);
     if (!mount) return -1;
     
     strncpy(mount->device, device, 63);
@@ -0,0 +1,38 @@
+#include "defer.h"
+#include <stdint.h>
+
+static void (*handlers[DEFER_MAX])(void);
+static uint32_t pending = 0;
+
+void defer_register(unsigned int slot, void (*handler)(void)) {
+    if (slot < DEFER_MAX) handlers[slot] = handler;
+}
+
+void defer_raise(unsigned int slot) {
+    if (slot < DEFER_MAX) __atomic_fetch_or(&pending, 1U << slot, __ATOMIC_RELEASE);
+}
+
+bool defer_pending(void) {
+    return __atomic_load_n(&pending, __ATOMIC_RELAXED) != 0;
+}
+
+void defer_run(void) {
+    uint32_t work;
+    // A slot raised while its handler runs is picked up by the next pass
+    while ((work = __atomic_exchange_n(&pending, 0, __ATOMIC_ACQUIRE)) != 0) {
+        for (unsigned int slot = 0; slot < DEFER_MAX; slot++) {
+            if ((work & (1U << slot)) && handlers[slot]) handlers[slot]();
+        }
+    }
+}
+
+void defer_wait(void) {
+    asm volatile("cli" ::: "memory");
+    if (defer_pending()) {
+        asm volatile("sti" ::: "memory");
+        return;
+    }
+    // sti takes effect after the next instruction, so an interrupt arriving
+    // now wakes the hlt instead of slipping in before it
+    asm volatile("sti; hlt" ::: "memory");
+}
@@ -0,0 +1,33 @@
+#ifndef DEFER_H
+#define DEFER_H
+
+#include <stdbool.h>
+
+// ============================================================================
+// Deferred Work
+// ============================================================================
+
+// Interrupt handlers only capture data and raise their slot; the handler
+// registered for the slot then runs from the idle loop with interrupts
+// enabled, so slow work (drawing, running shell commands) never stretches
+// interrupt latency.
+enum {
+    DEFER_KEYBOARD,
+    DEFER_MAX
+};
+
+void defer_register(unsigned int slot, void (*handler)(void));
+
+// Safe from interrupt context
+void defer_raise(unsigned int slot);
+
+bool defer_pending(void);
+
+// Run every raised handler until none is left pending
+void defer_run(void);
+
+// Sleep until the next interrupt unless work is already pending; the check
+// and hlt cannot be split by an interrupt, so no wakeup is lost
+void defer_wait(void);
+
+#endif // DEFER_H
@@ -6,14 +6,20 @@
 #include "arch/x86_64/idt/idt.h"
 #include "mm/pmm.h"
 #include "mm/heap.h"
+#include "mm/vmalloc.h"
+#include "mm/vma.h"
 #include "arch/x86_64/paging/vmm/vmm.h"
 #include "syscall/syscall.h"
 #include "driver/pci/pci.h"
 #include "driver/ahci/ahci.h"
+#include "driver/acpi/acpi.h"
+#include "arch/x86_64/apic/apic.h"
 #include "fs/vfs/vfs.h"
 #include "fs/kifs/kifs.h"
 #include "gfx/2d/gfx.h"
 #include "elf/kielf.h"
+#include "arch/x86_64/cpu/cpu.h"
+#include "kernel/defer.h"
 
 __attribute__((used, section(".requests")))
 static volatile struct limine_framebuffer_request framebuffer_request = { .id = LIMINE_FRAMEBUFFER_REQUEST, .revision = 0 };
@@ -21,12 +27,25 @@ __attribute__((used, section(".requests")))
 static volatile struct limine_memmap_request memmap_request = { .id = LIMINE_MEMMAP_REQUEST, .revision = 0 };
 __attribute__((used, section(".requests")))
 static volatile struct limine_hhdm_request hhdm_request = { .id = LIMINE_HHDM_REQUEST, .revision = 0 };
+__attribute__((used, section(".requests")))
+static volatile struct limine_kernel_address_request kernel_address_request = { .id = LIMINE_KERNEL_ADDRESS_REQUEST, .revision = 0 };
+__attribute__((used, section(".requests")))
+static volatile struct limine_rsdp_request rsdp_request = { .id = LIMINE_RSDP_REQUEST, .revision = 0 };
+
+// Limine responses live in bootloader-reclaimable memory, so everything we
+// still need after boot is copied here before that memory is handed to the PMM
+static struct limine_framebuffer framebuffer;
+static struct limine_framebuffer *framebuffer_ptr = NULL;
+static uint64_t hhdm_offset = 0;
+
+#define KERNEL_STACK_SIZE (64 * 1024)
+__attribute__((used, aligned(16)))
+static uint8_t kernel_stack[KERNEL_STACK_SIZE];
 
 void halt(void) { asm("cli"); for (;;) asm("hlt"); }
 
 void* get_framebuffer(void) {
-    if (framebuffer_request.response == NULL || framebuffer_request.response->framebuffer_count < 1) return NULL;
-    return framebuffer_request.response->framebuffers[0];
+    return framebuffer_ptr;
 }
 
 // === Графический движок ===
@@ -52,6 +71,12 @@ int strcmp(const char *s1, const char *s2) {
     return *(const unsigned char*)s1 - *(const unsigned char*)s2;
 }
 
+size_t strlen(const char *s) {
+    size_t n = 0;
+    while (s[n]) n++;
+    return n;
+}
+
 void itoa(uint64_t n, char *str) {
     int i = 0;
     if (n == 0) str[i++] = '0';
@@ -60,6 +85,16 @@ void itoa(uint64_t n, char *str) {
     for (int j = 0; j < i / 2; j++) { char t = str[j]; str[j] = str[i-j-1]; str[i-j-1] = t; }
 }
 
+void xtoa(uint64_t n, char *str) {
+    const char *hex = "0123456789abcdef";
+    int i = 0;
+    str[i++] = '0'; str[i++] = 'x';
+    int shift = 60;
+    while (shift > 0 && ((n >> shift) & 0xF) == 0) shift -= 4;
+    for (; shift >= 0; shift -= 4) str[i++] = hex[(n >> shift) & 0xF];
+    str[i] = '\0';
+}
+
 char* strncpy(char* dest, const char* src, uint64_t n) {
     uint64_t i = 0;
     while (i < n && src[i] != '\0') {
@@ -108,7 +143,7 @@ void execute_command(const char* cmd) {
     shell_y += 20;
     
     if (strcmp(cmd, "help") == 0) {
-        draw_string(fb, "Cmds: help about clear mem color disk vfs format ls demo kielf hello", 10, shell_y, current_text_color);
+        draw_string(fb, "Cmds: help about clear mem slabinfo heapprof color disk vfs format ls demo kielf hello", 10, shell_y, current_text_color);
     } else if (strcmp(cmd, "about") == 0) {
         draw_string(fb, "KiOS v0.1.0 - 64-bit microkernel.", 10, shell_y, current_text_color);
         shell_y += 15;
@@ -119,6 +154,109 @@ void execute_command(const char* cmd) {
         itoa(pmm_get_free_memory() / 1024 / 1024, buf);
         draw_string(fb, buf, 90, shell_y, color_green);
         draw_string(fb, " MB", 90 + (8*4), shell_y, current_text_color);
+
+        pmm_pcp_stats_t pcp;
+        pmm_get_pcp_stats(&pcp);
+        uint64_t lookups = pcp.hits + pcp.misses;
+        shell_y += 15;
+        draw_string(fb, "Per-CPU magazine hits: ", 10, shell_y, current_text_color);
+        itoa(lookups ? pcp.hits * 100 / lookups : 0, buf);
+        draw_string(fb, buf, 194, shell_y, color_green);
+        draw_string(fb, "%", 194 + 8 * strlen(buf), shell_y, current_text_color);
+
+        shell_y += 15;
+        uint32_t x = 10;
+        for (int zone = 0; zone < PMM_ZONE_COUNT; zone++) {
+            const char* name = pmm_get_zone_name(zone);
+            draw_string(fb, name, x, shell_y, current_text_color);
+            x += 8 * (strlen(name) + 1);
+            itoa(pmm_get_zone_free_memory(zone) / 1024 / 1024, buf);
+            draw_string(fb, buf, x, shell_y, color_green);
+            x += 8 * (strlen(buf) + 1);
+            draw_string(fb, "MB  ", x, shell_y, current_text_color);
+            x += 8 * 4;
+        }
+
+        shell_y += 15;
+        draw_string(fb, "Reclaimed from boot: ", 10, shell_y, current_text_color);
+        itoa(pmm_get_reclaimed_memory() / 1024, buf);
+        draw_string(fb, buf, 178, shell_y, color_green);
+        draw_string(fb, " KB", 178 + 8 * strlen(buf), shell_y, current_text_color);
+    } else if (strcmp(cmd, "slabinfo") == 0) {
+        char buf[32];
+        draw_string(fb, "Cache           Size  Active Total  Slabs  Hit%", 10, shell_y, color_dim);
+        kmem_cache_stats_t st;
+        for (size_t i = 0; kmem_cache_get_stats(i, &st); i++) {
+            // Пустые кэши не показываем, чтобы список влез на экран
+            if (st.slabs == 0 && st.hits + st.misses == 0) continue;
+            shell_y += 15;
+            draw_string(fb, st.name, 10, shell_y, current_text_color);
+            uint64_t cols[5] = { st.object_size, st.active, st.objects, st.slabs, 0 };
+            uint64_t allocs = st.hits + st.misses;
+            cols[4] = allocs ? st.hits * 100 / allocs : 0;
+            uint32_t x = 10 + 8 * 16;
+            for (int c = 0; c < 5; c++) {
+                itoa(cols[c], buf);
+                draw_string(fb, buf, x, shell_y, color_green);
+                x += 8 * (c == 0 ? 6 : 7);
+            }
+        }
+        shell_y += 15;
+        draw_string(fb, "Heap used/total: ", 10, shell_y, current_text_color);
+        itoa(heap_get_used() / 1024, buf);
+        draw_string(fb, buf, 146, shell_y, color_green);
+        uint32_t x = 146 + 8 * strlen(buf);
+        draw_string(fb, " / ", x, shell_y, current_text_color);
+        x += 8 * 3;
+        itoa(heap_get_total() / 1024, buf);
+        draw_string(fb, buf, x, shell_y, color_green);
+        draw_string(fb, " KB", x + 8 * strlen(buf), shell_y, current_text_color);
+    } else if (strcmp(cmd, "heapprof on") == 0) {
+        if (heapprof_enable(true)) {
+            draw_string(fb, "Heap profiler: ON", 10, shell_y, color_green);
+        } else {
+            draw_string(fb, "Heap profiler: no memory for table", 10, shell_y, color_red);
+        }
+    } else if (strcmp(cmd, "heapprof off") == 0) {
+        heapprof_enable(false);
+        draw_string(fb, "Heap profiler: OFF", 10, shell_y, current_text_color);
+    } else if (strcmp(cmd, "heapprof snap a") == 0 || strcmp(cmd, "heapprof snap b") == 0) {
+        bool b = strcmp(cmd, "heapprof snap b") == 0;
+        heapprof_snapshot(b ? HEAPPROF_SNAP_B : HEAPPROF_SNAP_A);
+        draw_string(fb, b ? "Heap profiler: snapshot B taken" : "Heap profiler: snapshot A taken",
+                    10, shell_y, current_text_color);
+    } else if (strcmp(cmd, "heapprof top") == 0 || strcmp(cmd, "heapprof diff") == 0) {
+        bool diff = strcmp(cmd, "heapprof diff") == 0;
+        heapprof_site_t sites[8];
+        size_t count = diff ? heapprof_diff(sites, 8) : heapprof_top(sites, 8);
+        char buf[32];
+        if (!heapprof_is_enabled()) {
+            draw_string(fb, "Heap profiler is off. Use 'heapprof on'.", 10, shell_y, color_red);
+        } else {
+            draw_string(fb, diff ? "Site                Bytes+    Count+" : "Site                Bytes     Count",
+                        10, shell_y, color_dim);
+            for (size_t i = 0; i < count; i++) {
+                shell_y += 15;
+                xtoa((uint64_t)sites[i].site, buf);
+                draw_string(fb, buf, 10, shell_y, current_text_color);
+                itoa(sites[i].bytes, buf);
+                draw_string(fb, buf, 10 + 8 * 20, shell_y, color_green);
+                itoa(sites[i].count, buf);
+                draw_string(fb, buf, 10 + 8 * 30, shell_y, color_green);
+            }
+            if (heapprof_get_dropped()) {
+                shell_y += 15;
+                itoa(heapprof_get_dropped(), buf);
+                draw_string(fb, "Untracked (table full): ", 10, shell_y, color_yellow);
+                draw_string(fb, buf, 10 + 8 * 24, shell_y, color_yellow);
+            }
+        }
+    } else if (strcmp(cmd, "heapprof") == 0) {
+        draw_string(fb, "Usage: heapprof on|off|top|snap a|snap b|diff", 10, shell_y, current_text_color);
+        shell_y += 15;
+        draw_string(fb, "  snap a, snap b: remember live allocations per site", 10, shell_y, color_dim);
+        shell_y += 15;
+        draw_string(fb, "  diff: sites that grew from snapshot A to snapshot B", 10, shell_y, color_dim);
     } else if (strcmp(cmd, "clear") == 0) {
         clear_screen(fb);
         return;
@@ -131,8 +269,10 @@ void execute_command(const char* cmd) {
     } else if (strcmp(cmd, "vfs") == 0) {
         draw_string(fb, "VFS: Ready. Use 'format' to format disk.", 10, shell_y, current_text_color);
     } else if (strcmp(cmd, "format") == 0) {
-        // Simple RAM disk for now (16MB)
-        void* ramdisk = pmm_alloc_page();
+        // Simple RAM disk for now (16MB), reserved in the vmalloc area and
+        // backed page by page as KiFS touches it
+        static void* ramdisk = NULL;
+        if (!ramdisk) ramdisk = vmalloc_reserve(16 * 1024 * 1024);
         if (ramdisk) {
             kifs_format(ramdisk, 16 * 1024 * 1024);
             draw_string(fb, "Format: RAM disk formatted (16MB).", 10, shell_y, color_green);
@@ -206,9 +346,15 @@ void on_key_pressed(char c) {
     }
 }
 
-void _start(void) {
+void kmain(void) {
+    if (framebuffer_request.response == NULL || framebuffer_request.response->framebuffer_count < 1) halt();
+    framebuffer = *framebuffer_request.response->framebuffers[0];
+    framebuffer_ptr = &framebuffer;
+    hhdm_offset = hhdm_request.response->offset;
+    if (kernel_address_request.response == NULL) halt();
+    uint64_t kernel_phys = kernel_address_request.response->physical_base;
+
     struct limine_framebuffer *fb = get_framebuffer();
-    if (!fb) halt();
 
     uint32_t *fb_ptr = fb->address;
     for (uint32_t i = 0; i < fb->width * fb->height; i++) fb_ptr[i] = color_bg;
@@ -232,18 +378,43 @@ void _start(void) {
     boot_y += 18;
     
     // PMM
-    pmm_init(&memmap_request, hhdm_request.response->offset);
+    pmm_init(&memmap_request, hhdm_offset);
     draw_string(fb, "[BOOT] Initializing PMM... OK", 10, boot_y, color_green);
     boot_y += 18;
     
+    // VMM (the heap maps large allocations into the vmalloc area)
+    vmm_init(hhdm_offset, pmm_get_phys_limit(), kernel_phys);
+    
+    // The direct map leaves the framebuffer out; a write-combining mapping
+    // turns full-screen blits into burst writes
+    void *fb_wc = vmm_map_mmio((uint64_t)fb->address - hhdm_offset, fb->pitch * fb->height, VMM_CACHE_WC);
+    if (!fb_wc) halt();
+    fb->address = fb_wc;
+    fb_ptr = fb_wc;
+    
+    draw_string(fb, "[BOOT] Enabling virtual memory... OK", 10, boot_y, color_green);
+    boot_y += 18;
+    
     // Heap
-    heap_init(hhdm_request.response->offset);
+    heap_init(hhdm_offset);
+    vma_init();
     draw_string(fb, "[BOOT] Allocating kernel heap... OK", 10, boot_y, color_green);
     boot_y += 18;
     
-    // VMM
-    vmm_init();
-    draw_string(fb, "[BOOT] Enabling virtual memory... OK", 10, boot_y, color_green);
+    // Interrupt controllers: the MADT sits in ACPI-reclaimable memory, so
+    // this has to happen before the reclaim below. Limine hands out the RSDP
+    // as an HHDM pointer.
+    uint64_t rsdp = 0;
+    if (rsdp_request.response) {
+        rsdp = (uint64_t)rsdp_request.response->address;
+        if (rsdp >= hhdm_offset) rsdp -= hhdm_offset;
+    }
+    if (acpi_init(rsdp, hhdm_offset) && apic_init()) {
+        apic_route_isa_irq(1, IRQ_VECTOR_BASE + 1, 0);   // keyboard -> BSP
+        draw_string(fb, "[BOOT] Routing interrupts via APIC... OK", 10, boot_y, color_green);
+    } else {
+        draw_string(fb, "[BOOT] No MADT, staying on 8259 PIC", 10, boot_y, color_yellow);
+    }
     boot_y += 18;
     
     // Syscalls
@@ -270,6 +441,22 @@ void _start(void) {
     
     // KiELF
     draw_string(fb, "[BOOT] KiELF loader ready", 10, boot_y, color_dim);
+    boot_y += 18;
+    
+    // ACPI tables are gone after the reclaim, so the root table pointer goes first
+    acpi_release();
+    
+    // Reclaim bootloader memory: we run on our own stack, our own page tables
+    // and copies of the Limine responses, so nothing in it is live any more
+    uint64_t irq = cpu_irq_save();
+    uint64_t gained = 0;
+    gained += pmm_reclaim_memory(LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE);
+    gained += pmm_reclaim_memory(LIMINE_MEMMAP_ACPI_RECLAIMABLE);
+    cpu_irq_restore(irq);
+    char kb[32];
+    itoa(gained / 1024, kb);
+    draw_string(fb, "[BOOT] Reclaimed bootloader memory (KB):", 10, boot_y, color_green);
+    draw_string(fb, kb, 10 + 8 * 41, boot_y, color_green);
     boot_y += 25;
     
     // Boot complete
@@ -280,9 +467,11 @@ void _start(void) {
     
     draw_string(fb, "[BOOT] Press any key to continue...", 10, boot_y, color_yellow);
     
-    // Wait for key press
+    // Wait for key press, pre-zeroing pages while idle. Keys are handled as
+    // deferred work, outside the keyboard interrupt.
     while (!enter_pressed) {
-        asm volatile("hlt");
+        defer_run();
+        if (!enter_pressed && !pmm_zero_idle()) defer_wait();
     }
     boot_done = 1;
     
@@ -296,5 +485,23 @@ void _start(void) {
     shell_y = 110;
     draw_string(fb, PROMPT, 10, shell_y, color_yellow);
 
-    for (;;) asm("hlt");
+    // Idle loop: run deferred work (the shell), refill the zeroed page pool,
+    // sleep once both are done
+    for (;;) {
+        defer_run();
+        if (!pmm_zero_idle()) defer_wait();
+    }
+}
+
+// Entry point: Limine's stack lives in bootloader-reclaimable memory,
+// so switch to the kernel's own stack before running any C code
+__attribute__((naked, noreturn))
+void _start(void) {
+    asm("lea kernel_stack + %c0(%%rip), %%rsp\n\t"
+        "xor %%rbp, %%rbp\n\t"
+        "call kmain\n\t"
+        "1: cli\n\t"
+        "hlt\n\t"
+        "jmp 1b"
+        :: "i"(KERNEL_STACK_SIZE));
 }
\ No newline at end of file
@@ -1,44 +1,571 @@
 #include "heap.h"
 #include "pmm.h"
+#include "page.h"
+#include "vmalloc.h"
+#include "arch/x86_64/cpu/cpu.h"
+
+// Slab-аллокатор. Каждый кэш — набор slab'ов: блоков 2^order страниц,
+// нарезанных на объекты одного размера. Метаданные slab'а живут в struct page
+// его головной страницы, поэтому объекты лежат с начала блока и выровнены
+// естественным образом. Свободные объекты связаны в список через 4 байта по
+// смещению free_off (смещение следующего свободного от начала slab'а).
+#define SLAB_FREE_END 0xFFFFFFFFU
+#define SLAB_MAX_EMPTY 1   // сколько пустых slab'ов держать про запас
+
+struct kmem_cache {
+    const char *name;
+    uint32_t object_size;  // размер, запрошенный создателем кэша
+    uint32_t size;         // шаг объектов в slab'е с учётом выравнивания
+    uint32_t align;
+    uint32_t free_off;     // где в свободном объекте лежит ссылка на следующий
+    uint32_t objects;      // объектов в одном slab'е
+    uint8_t order;
+    void (*ctor)(void *);
+    spinlock_t lock;
+    page_list_t partial;   // есть и занятые, и свободные объекты
+    page_list_t full;
+    page_list_t empty;
+    uint64_t active;       // занятых объектов во всех slab'ах
+    uint64_t slabs;
+    uint64_t hits;         // выдано из уже готовых slab'ов
+    uint64_t misses;       // пришлось заводить новый slab
+    struct kmem_cache *next;
+};
+
+// Классы kmalloc 16 B – 4 KiB: степени двойки и промежуточные 1.5x
+static struct kmem_cache size_caches[] = {
+    { .name = "kmalloc-16",   .object_size = 16   },
+    { .name = "kmalloc-32",   .object_size = 32   },
+    { .name = "kmalloc-48",   .object_size = 48   },
+    { .name = "kmalloc-64",   .object_size = 64   },
+    { .name = "kmalloc-96",   .object_size = 96   },
+    { .name = "kmalloc-128",  .object_size = 128  },
+    { .name = "kmalloc-192",  .object_size = 192  },
+    { .name = "kmalloc-256",  .object_size = 256  },
+    { .name = "kmalloc-384",  .object_size = 384  },
+    { .name = "kmalloc-512",  .object_size = 512  },
+    { .name = "kmalloc-768",  .object_size = 768  },
+    { .name = "kmalloc-1024", .object_size = 1024 },
+    { .name = "kmalloc-1536", .object_size = 1536 },
+    { .name = "kmalloc-2048", .object_size = 2048 },
+    { .name = "kmalloc-3072", .object_size = 3072 },
+    { .name = "kmalloc-4096", .object_size = 4096 },
+};
+
+#define SIZE_CLASS_COUNT (sizeof(size_caches) / sizeof(size_caches[0]))
+#define SLAB_MAX_SIZE 4096
 
-static uint64_t heap_start_addr = 0;
-static uint64_t heap_current = 0;
-static uint64_t heap_end = 0;
 static uint64_t hhdm_off = 0;
+static uint64_t heap_used = 0;    // байт в живых объектах
+static uint64_t heap_total = 0;   // байт страниц, взятых кучей у PMM
+
+// Все кэши, для статистики
+static struct kmem_cache *cache_list = NULL;
+static spinlock_t cache_list_lock = SPINLOCK_INIT;
+
+static uint32_t align_up(uint32_t value, uint32_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static void cache_init(struct kmem_cache *cache, size_t align, void (*ctor)(void *)) {
+    uint32_t size = align_up(cache->object_size < 4 ? 4 : cache->object_size, 4);
+    // Сконструированный объект нельзя портить ссылкой списка — она уходит в хвост
+    cache->free_off = ctor ? size : 0;
+    if (ctor) size += 4;
+    cache->size = align_up(size, align);
+    cache->align = align;
+    cache->ctor = ctor;
+
+    // Самый маленький slab, в котором на хвост уходит не больше 1/8
+    uint8_t order = 0;
+    while (order < 3) {
+        uint64_t slab = (uint64_t)PAGE_SIZE << order;
+        if (slab % cache->size <= slab / 8) break;
+        order++;
+    }
+    cache->order = order;
+    cache->objects = ((uint64_t)PAGE_SIZE << order) / cache->size;
+    cache->lock = (spinlock_t)SPINLOCK_INIT;
+    cache->partial = (page_list_t)PAGE_LIST_INIT;
+    cache->full = (page_list_t)PAGE_LIST_INIT;
+    cache->empty = (page_list_t)PAGE_LIST_INIT;
+    cache->active = cache->slabs = cache->hits = cache->misses = 0;
+
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    struct kmem_cache **tail = &cache_list;
+    while (*tail) tail = &(*tail)->next;
+    cache->next = NULL;
+    *tail = cache;
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+}
+
+static uint8_t *slab_base(struct page *head) {
+    return (uint8_t *)(page_to_phys(head) + hhdm_off);
+}
+
+// Одностраничные slab'ы идут через магазины PMM, не трогая общий pmm_lock
+static struct page *slab_grow(struct kmem_cache *cache) {
+    void *block = cache->order ? pmm_alloc_pages(cache->order) : pmm_alloc_page();
+    if (!block) return NULL;
+
+    struct page *head = phys_to_page((uint64_t)block);
+    for (uint64_t i = 0; i < (1ULL << cache->order); i++) {
+        head[i].owner = PAGE_OWNER_HEAP;
+        head[i].flags |= PG_SLAB;
+        head[i].order = cache->order;
+    }
+    head->slab_cache = cache;
+    head->slab_inuse = 0;
+
+    uint8_t *base = slab_base(head);
+    for (uint32_t i = 0; i < cache->objects; i++) {
+        uint8_t *obj = base + i * cache->size;
+        if (cache->ctor) cache->ctor(obj);
+        uint32_t next = (i + 1 < cache->objects) ? (i + 1) * cache->size : SLAB_FREE_END;
+        *(uint32_t *)(obj + cache->free_off) = next;
+    }
+    head->slab_free = 0;
+
+    cache->slabs++;
+    __atomic_add_fetch(&heap_total, (uint64_t)PAGE_SIZE << cache->order, __ATOMIC_RELAXED);
+    return head;
+}
+
+static void slab_release(struct kmem_cache *cache, struct page *head) {
+    for (uint64_t i = 0; i < (1ULL << cache->order); i++) {
+        head[i].flags &= ~PG_SLAB;
+        head[i].order = 0;
+    }
+    head->order = cache->order;
+    cache->slabs--;
+    __atomic_sub_fetch(&heap_total, (uint64_t)PAGE_SIZE << cache->order, __ATOMIC_RELAXED);
+    if (cache->order) pmm_free_pages((void *)page_to_phys(head), cache->order);
+    else pmm_free_page((void *)page_to_phys(head));
+}
+
+static void *cache_alloc(struct kmem_cache *cache) {
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    struct page *head = NULL;
+    if (cache->partial.head != PAGE_NO_PFN) {
+        head = pfn_to_page(cache->partial.head);
+        cache->hits++;
+    } else if (cache->empty.head != PAGE_NO_PFN) {
+        head = pfn_to_page(cache->empty.head);
+        page_list_del(&cache->empty, head);
+        page_list_add(&cache->partial, head);
+        cache->hits++;
+    } else {
+        head = slab_grow(cache);
+        if (!head) {
+            spin_unlock_irqrestore(&cache->lock, flags);
+            return NULL;
+        }
+        page_list_add(&cache->partial, head);
+        cache->misses++;
+    }
+
+    uint8_t *obj = slab_base(head) + head->slab_free;
+    head->slab_free = *(uint32_t *)(obj + cache->free_off);
+    head->slab_inuse++;
+    if (head->slab_inuse == cache->objects) {
+        page_list_del(&cache->partial, head);
+        page_list_add(&cache->full, head);
+    }
+    cache->active++;
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+    __atomic_add_fetch(&heap_used, cache->size, __ATOMIC_RELAXED);
+    return obj;
+}
+
+static void cache_free(struct kmem_cache *cache, struct page *head, void *ptr) {
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    uint8_t *base = slab_base(head);
+    uint32_t offset = (uint8_t *)ptr - base;
+    *(uint32_t *)((uint8_t *)ptr + cache->free_off) = head->slab_free;
+    head->slab_free = offset;
+
+    if (head->slab_inuse == cache->objects) {
+        page_list_del(&cache->full, head);
+        page_list_add(&cache->partial, head);
+    }
+    head->slab_inuse--;
+    cache->active--;
+
+    if (head->slab_inuse == 0) {
+        page_list_del(&cache->partial, head);
+        if (cache->empty.count < SLAB_MAX_EMPTY) {
+            page_list_add(&cache->empty, head);
+        } else {
+            slab_release(cache, head);
+        }
+    }
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+    __atomic_sub_fetch(&heap_used, cache->size, __ATOMIC_RELAXED);
+}
+
+// Голова slab'а, которому принадлежит объект, или NULL для чужого адреса
+static struct page *obj_to_slab(void *ptr) {
+    struct page *page = phys_to_page((uint64_t)ptr - hhdm_off);
+    if (!page || page->owner != PAGE_OWNER_HEAP || !(page->flags & PG_SLAB)) return NULL;
+    return pfn_to_page(page_to_pfn(page) & ~((1ULL << page->order) - 1));
+}
+
+// Профилировщик: живые выделения в хэш-таблице с линейным пробированием,
+// ключ — адрес объекта. Пока режим выключен, на пути выделения остаётся одна
+// проверка флага, а таблица не существует.
+#define PROF_SLOTS 8192              // степень двойки
+#define PROF_MAX_LIVE (PROF_SLOTS / 4 * 3)
+#define PROF_SITES 256
+
+struct prof_entry {
+    uint64_t ptr;       // 0 — пустой слот
+    void *site;
+    uint64_t size;
+    uint64_t time;      // TSC в момент выделения
+};
+
+static struct prof_entry *prof_table = NULL;
+static bool prof_enabled = false;
+static spinlock_t prof_lock = SPINLOCK_INIT;
+static uint64_t prof_live = 0;
+static uint64_t prof_dropped = 0;   // не влезли в таблицу
+static heapprof_site_t prof_sites[PROF_SITES];
+static heapprof_site_t prof_snap[HEAPPROF_SNAPSHOTS][PROF_SITES];
+static size_t prof_snap_count[HEAPPROF_SNAPSHOTS];
+
+static size_t prof_hash(uint64_t ptr) {
+    return ((ptr >> 4) * 0x9E3779B97F4A7C15ULL) >> 51;   // 13 бит
+}
+
+static void prof_record(void *ptr, size_t size, void *site) {
+    if (!ptr) return;
+    uint64_t flags = spin_lock_irqsave(&prof_lock);
+    if (prof_table && prof_live < PROF_MAX_LIVE) {
+        size_t i = prof_hash((uint64_t)ptr);
+        while (prof_table[i].ptr) i = (i + 1) & (PROF_SLOTS - 1);
+        prof_table[i] = (struct prof_entry){ (uint64_t)ptr, site, size, cpu_rdtsc() };
+        prof_live++;
+    } else {
+        prof_dropped++;
+    }
+    spin_unlock_irqrestore(&prof_lock, flags);
+}
+
+// Удаление со сдвигом назад, чтобы цепочки пробирования не рвались
+static void prof_forget(void *ptr) {
+    uint64_t flags = spin_lock_irqsave(&prof_lock);
+    if (!prof_table) {
+        spin_unlock_irqrestore(&prof_lock, flags);
+        return;
+    }
+    size_t mask = PROF_SLOTS - 1;
+    size_t i = prof_hash((uint64_t)ptr);
+    while (prof_table[i].ptr && prof_table[i].ptr != (uint64_t)ptr) i = (i + 1) & mask;
+    if (prof_table[i].ptr) {
+        size_t j = i;
+        for (;;) {
+            j = (j + 1) & mask;
+            if (!prof_table[j].ptr) break;
+            size_t home = prof_hash(prof_table[j].ptr);
+            if (((j - home) & mask) < ((j - i) & mask)) continue;
+            prof_table[i] = prof_table[j];
+            i = j;
+        }
+        prof_table[i].ptr = 0;
+        prof_live--;
+    }
+    spin_unlock_irqrestore(&prof_lock, flags);
+}
+
+// Сворачивает живые выделения по местам вызова, сортирует по байтам
+// По убыванию bytes, вставками: мест не больше PROF_SITES
+static void prof_sort(heapprof_site_t *sites, size_t count) {
+    for (size_t i = 1; i < count; i++) {
+        heapprof_site_t site = sites[i];
+        size_t j = i;
+        while (j > 0 && sites[j - 1].bytes < site.bytes) {
+            sites[j] = sites[j - 1];
+            j--;
+        }
+        sites[j] = site;
+    }
+}
+
+static size_t prof_collect(heapprof_site_t *sites) {
+    size_t count = 0;
+    for (size_t i = 0; i < PROF_SLOTS; i++) {
+        struct prof_entry *e = &prof_table[i];
+        if (!e->ptr) continue;
+        size_t s = 0;
+        while (s < count && sites[s].site != e->site) s++;
+        if (s == count) {
+            if (count == PROF_SITES) continue;
+            sites[count++] = (heapprof_site_t){ e->site, 0, 0, e->time };
+        }
+        sites[s].bytes += e->size;
+        sites[s].count++;
+        if (e->time < sites[s].oldest) sites[s].oldest = e->time;
+    }
+    prof_sort(sites, count);
+    return count;
+}
+
+bool heapprof_enable(bool on) {
+    if (on && !prof_table) {
+        // Таблица берётся из vmalloc один раз и дальше живёт всегда
+        struct prof_entry *table = vmalloc(PROF_SLOTS * sizeof(struct prof_entry));
+        if (!table) return false;
+        for (size_t i = 0; i < PROF_SLOTS; i++) table[i].ptr = 0;
+        uint64_t flags = spin_lock_irqsave(&prof_lock);
+        prof_table = table;
+        spin_unlock_irqrestore(&prof_lock, flags);
+    }
+
+    uint64_t flags = spin_lock_irqsave(&prof_lock);
+    if (!on && prof_table) {
+        for (size_t i = 0; i < PROF_SLOTS; i++) prof_table[i].ptr = 0;
+        prof_live = 0;
+    }
+    prof_dropped = 0;
+    prof_enabled = on;
+    spin_unlock_irqrestore(&prof_lock, flags);
+    return true;
+}
+
+bool heapprof_is_enabled(void) { return prof_enabled; }
+uint64_t heapprof_get_dropped(void) { return prof_dropped; }
+
+size_t heapprof_top(heapprof_site_t *out, size_t max) {
+    uint64_t flags = spin_lock_irqsave(&prof_lock);
+    size_t count = prof_table ? prof_collect(prof_sites) : 0;
+    if (count > max) count = max;
+    for (size_t i = 0; i < count; i++) out[i] = prof_sites[i];
+    spin_unlock_irqrestore(&prof_lock, flags);
+    return count;
+}
+
+bool heapprof_snapshot(int slot) {
+    if (slot < 0 || slot >= HEAPPROF_SNAPSHOTS) return false;
+    uint64_t flags = spin_lock_irqsave(&prof_lock);
+    prof_snap_count[slot] = prof_table ? prof_collect(prof_snap[slot]) : 0;
+    spin_unlock_irqrestore(&prof_lock, flags);
+    return true;
+}
+
+// Места, которые между снимками A и B стали держать больше памяти, по
+// убыванию прироста; не выросшие в выдачу не попадают
+size_t heapprof_diff(heapprof_site_t *out, size_t max) {
+    const heapprof_site_t *before = prof_snap[HEAPPROF_SNAP_A];
+    const heapprof_site_t *after = prof_snap[HEAPPROF_SNAP_B];
+    uint64_t flags = spin_lock_irqsave(&prof_lock);
+    size_t grown = 0;
+    for (size_t i = 0; i < prof_snap_count[HEAPPROF_SNAP_B]; i++) {
+        heapprof_site_t site = after[i];
+        for (size_t j = 0; j < prof_snap_count[HEAPPROF_SNAP_A]; j++) {
+            if (before[j].site != site.site) continue;
+            site.bytes -= before[j].bytes;
+            site.count -= before[j].count;
+            break;
+        }
+        if (site.bytes > 0) prof_sites[grown++] = site;
+    }
+    prof_sort(prof_sites, grown);
+    if (grown > max) grown = max;
+    for (size_t i = 0; i < grown; i++) out[i] = prof_sites[i];
+    spin_unlock_irqrestore(&prof_lock, flags);
+    return grown;
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *)) {
+    if (size == 0 || size > SLAB_MAX_SIZE) return NULL;
+    if (align == 0) align = 8;
+    if ((align & (align - 1)) || align > PAGE_SIZE) return NULL;
+
+    struct kmem_cache *cache = kmalloc(sizeof(struct kmem_cache));
+    if (!cache) return NULL;
+    cache->name = name;
+    cache->object_size = size;
+    cache_init(cache, align, ctor);
+    return cache;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    void *obj = cache_alloc(cache);
+    if (__builtin_expect(prof_enabled, 0)) prof_record(obj, cache->object_size, __builtin_return_address(0));
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (obj == NULL) return;
+    struct page *head = obj_to_slab(obj);
+    if (!head || head->slab_cache != cache) return;
+    if (__builtin_expect(prof_enabled, 0)) prof_forget(obj);
+    cache_free(cache, head, obj);
+}
+
+bool kmem_cache_get_stats(size_t index, kmem_cache_stats_t *stats) {
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    struct kmem_cache *cache = cache_list;
+    while (cache && index--) cache = cache->next;
+    if (cache) {
+        stats->name = cache->name;
+        stats->object_size = cache->object_size;
+        stats->active = cache->active;
+        stats->objects = cache->slabs * cache->objects;
+        stats->slabs = cache->slabs;
+        stats->hits = cache->hits;
+        stats->misses = cache->misses;
+    }
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+    return cache != NULL;
+}
+
+// Самый маленький класс, который вмещает size и выровнен хотя бы на align
+static struct kmem_cache *size_to_cache(size_t size, size_t align) {
+    for (size_t i = 0; i < SIZE_CLASS_COUNT; i++) {
+        if (size <= size_caches[i].object_size && size_caches[i].align >= align) return &size_caches[i];
+    }
+    return NULL;
+}
+
+static void heap_zero(void *dst, size_t n) {
+    asm volatile("rep stosb" : "+D"(dst), "+c"(n) : "a"(0) : "memory");
+}
+
+static void heap_copy(void *dst, const void *src, size_t n) {
+    asm volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) :: "memory");
+}
 
 void heap_init(uint64_t hhdm_offset) {
     hhdm_off = hhdm_offset;
-    void* phys_page = pmm_alloc_page();
-    if (phys_page == NULL) return;
+    for (size_t i = 0; i < SIZE_CLASS_COUNT; i++) {
+        // Классы-степени двойки выровнены по своему размеру, остальные — по 16
+        uint32_t size = size_caches[i].object_size;
+        cache_init(&size_caches[i], (size & (size - 1)) ? 16 : size, NULL);
+    }
+    vmalloc_init();
+}
 
-    heap_start_addr = (uint64_t)phys_page + hhdm_off;
-    heap_current = heap_start_addr;
-    heap_end = heap_current + PAGE_SIZE;
+// Общий путь выделения без профилировщика: align — степень двойки
+static void* heap_alloc(size_t size, size_t align) {
+    if (size == 0 || (align & (align - 1)) || align > PAGE_SIZE) return NULL;
+
+    // Крупные запросы — в vmalloc: им не нужны соседние физические кадры,
+    // а начало области и так выровнено на страницу
+    if (size > SLAB_MAX_SIZE) {
+        void* ptr = vmalloc_heap(size);
+        if (ptr == NULL) return NULL; // Совсем кончилась память в ПК
+
+        uint64_t bytes = vmalloc_size(ptr);
+        __atomic_add_fetch(&heap_total, bytes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&heap_used, bytes, __ATOMIC_RELAXED);
+        return ptr;
+    }
+
+    return cache_alloc(size_to_cache(size, align));
 }
 
 void* kmalloc(size_t size) {
-    // Выравнивание по 8 байт для стабильности
-    size = (size + 7) & ~7;
+    void* ptr = heap_alloc(size, 0);
+    if (__builtin_expect(prof_enabled, 0)) prof_record(ptr, size, __builtin_return_address(0));
+    return ptr;
+}
 
-    // Если места не хватает — расширяем кучу!
-    while (heap_current + size > heap_end) {
-        void* new_page = pmm_alloc_page();
-        if (new_page == NULL) return NULL; // Совсем кончилась память в ПК
+void* kmalloc_aligned(size_t size, size_t align) {
+    void* ptr = heap_alloc(size, align);
+    if (__builtin_expect(prof_enabled, 0)) prof_record(ptr, size, __builtin_return_address(0));
+    return ptr;
+}
+
+void* kcalloc(size_t count, size_t size) {
+    if (size && count > SIZE_MAX / size) return NULL;
+    void* ptr = heap_alloc(count * size, 0);
+    if (ptr) heap_zero(ptr, count * size);
+    if (__builtin_expect(prof_enabled, 0)) prof_record(ptr, count * size, __builtin_return_address(0));
+    return ptr;
+}
 
-        // В текущей реализации (без VMM) мы просто надеемся, 
-        // что PMM выдаст нам следующую физическую страницу подряд.
-        // Для простого ядра на старте это работает.
-        heap_end += PAGE_SIZE;
+// Размер класса или области всегда не меньше запрошенного, поэтому пока
+// новый размер в него влезает, объект остаётся на месте. vmalloc-области
+// ещё и доращиваются на месте, если позади свободно.
+void* krealloc(void* ptr, size_t size) {
+    void* site = __builtin_return_address(0);
+    if (ptr == NULL) {
+        ptr = heap_alloc(size, 0);
+        if (__builtin_expect(prof_enabled, 0)) prof_record(ptr, size, site);
+        return ptr;
+    }
+    if (size == 0) {
+        kfree(ptr);
+        return NULL;
     }
 
-    void* ptr = (void*)heap_current;
-    heap_current += size;
-    return ptr;
+    size_t old_size;
+    size_t old_align = 0;   // vmalloc-области и так выровнены на страницу
+    bool in_place = false;
+    if (is_vmalloc_addr(ptr)) {
+        old_size = vmalloc_size(ptr);
+        if (old_size == 0) return NULL;
+        if (size <= old_size) {
+            in_place = true;
+        } else if (vmalloc_grow(ptr, size)) {
+            // Голый vmalloc-буфер растёт, но в счётчики кучи не попадает
+            if (vmalloc_is_heap(ptr)) {
+                uint64_t added = vmalloc_size(ptr) - old_size;
+                __atomic_add_fetch(&heap_total, added, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&heap_used, added, __ATOMIC_RELAXED);
+            }
+            in_place = true;
+        }
+    } else {
+        struct page *head = obj_to_slab(ptr);
+        if (!head) return NULL;
+        old_size = head->slab_cache->object_size;
+        old_align = head->slab_cache->align;
+        in_place = size <= old_size;
+    }
+
+    if (in_place) {
+        if (__builtin_expect(prof_enabled, 0)) {
+            prof_forget(ptr);
+            prof_record(ptr, size, site);
+        }
+        return ptr;
+    }
+
+    // Выравнивание класса сохраняется: объект мог прийти из kmalloc_aligned.
+    // Старый объект остаётся целым, если на новый не хватило памяти
+    void* new_ptr = heap_alloc(size, old_align);
+    if (new_ptr == NULL) return NULL;
+    heap_copy(new_ptr, ptr, old_size);
+    kfree(ptr);
+    if (__builtin_expect(prof_enabled, 0)) prof_record(new_ptr, size, site);
+    return new_ptr;
 }
 
+// O(1) для slab-объектов: владелец находится по struct page их кадра
 void kfree(void* ptr) {
-    (void)ptr; // Всё еще заглушка, пока не перейдем на сложный аллокатор
+    if (ptr == NULL) return;
+    if (__builtin_expect(prof_enabled, 0)) prof_forget(ptr);
+
+    // Указатель из vmalloc() напрямую в кучу не входил — просто vfree
+    if (is_vmalloc_addr(ptr)) {
+        if (vmalloc_is_heap(ptr)) {
+            uint64_t bytes = vmalloc_size(ptr);
+            __atomic_sub_fetch(&heap_total, bytes, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&heap_used, bytes, __ATOMIC_RELAXED);
+        }
+        vfree(ptr);
+        return;
+    }
+
+    struct page *head = obj_to_slab(ptr);
+    if (head) cache_free(head->slab_cache, head, ptr);
 }
 
-uint64_t heap_get_used() { return heap_current - heap_start_addr; }
-uint64_t heap_get_total() { return heap_end - heap_start_addr; }
\ No newline at end of file
+uint64_t heap_get_used() { return heap_used; }
+uint64_t heap_get_total() { return heap_total; }
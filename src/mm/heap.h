@@ -1,11 +1,69 @@
 #pragma once
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 void* kmalloc(size_t size);
 void kfree(void* ptr);
+
+// Выравнивание — степень двойки до PAGE_SIZE. Блоки до 4 KiB берутся из
+// прямого отображения и физически непрерывны, крупнее — из vmalloc.
+void* kmalloc_aligned(size_t size, size_t align);
+void* kcalloc(size_t count, size_t size);
+
+// Меняет размер, по возможности на месте; при ошибке старый блок цел.
+// Переезжающий блок выровнен не хуже прежнего
+void* krealloc(void* ptr, size_t size);
 void heap_init(uint64_t hhdm_offset);
 
+// Кэши объектов фиксированного размера. Конструктор вызывается один раз,
+// когда объект появляется в новом slab'е; возвращать объект в кэш нужно в
+// сконструированном состоянии. Выравнивание — степень двойки, 0 — по 8 байт.
+#define KMEM_CACHE_LINE 64
+
+typedef struct kmem_cache kmem_cache_t;
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void*));
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+typedef struct {
+    const char* name;
+    uint32_t object_size;
+    uint64_t active;   // объектов выдано
+    uint64_t objects;  // объектов во всех slab'ах кэша
+    uint64_t slabs;
+    uint64_t hits;     // выделений из уже готовых slab'ов
+    uint64_t misses;   // выделений, потребовавших новый slab
+} kmem_cache_stats_t;
+
+// Статистика index-го кэша; false, если кэшей меньше
+bool kmem_cache_get_stats(size_t index, kmem_cache_stats_t* stats);
+
+// Профилировщик кучи: при включённом режиме каждое живое выделение помнит
+// место вызова, размер и TSC. Выключение очищает таблицу.
+typedef struct {
+    void* site;        // адрес возврата в вызывающий код
+    int64_t bytes;
+    int64_t count;
+    uint64_t oldest;   // TSC самого старого живого выделения
+} heapprof_site_t;
+
+bool heapprof_enable(bool on);
+bool heapprof_is_enabled(void);
+uint64_t heapprof_get_dropped(void);   // выделений, не попавших в таблицу
+
+// Места вызова по убыванию удерживаемых байт
+size_t heapprof_top(heapprof_site_t* out, size_t max);
+
+// Два снимка для поиска утечек: diff показывает прирост от A к B
+#define HEAPPROF_SNAP_A 0
+#define HEAPPROF_SNAP_B 1
+#define HEAPPROF_SNAPSHOTS 2
+
+bool heapprof_snapshot(int slot);
+size_t heapprof_diff(heapprof_site_t* out, size_t max);
+
 // Статистика кучи
 uint64_t heap_get_used();
-uint64_t heap_get_total();
\ No newline at end of file
+uint64_t heap_get_total();
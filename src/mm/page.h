@@ -0,0 +1,91 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "pmm.h"
+
+struct kmem_cache;
+
+// База данных физических кадров: по одной struct page на каждый PFN до конца
+// RAM. 32 байта — две записи на кэш-линию, 0.8% от объёма памяти.
+struct page {
+    uint32_t refcount;   // 0 — кадр свободен
+    uint16_t flags;      // PG_*
+    uint8_t  owner;      // PAGE_OWNER_*
+    uint8_t  order;      // порядок buddy-блока (у головной страницы)
+    uint32_t lru_next;   // PFN соседей по списку, PAGE_NO_PFN — конец
+    uint32_t lru_prev;
+    union {
+        uint64_t private;              // данные владельца
+        struct kmem_cache *slab_cache; // PG_SLAB: кэш, которому принадлежит slab
+        uint64_t pt_entries;           // PAGE_OWNER_PAGETABLE: присутствующих записей
+    };
+    union {
+        uint64_t index;                // смещение кадра внутри объекта-владельца
+        struct {
+            uint32_t slab_free;        // PG_SLAB: смещение первого свободного объекта
+            uint32_t slab_inuse;       // PG_SLAB: занятых объектов
+        };
+    };
+};
+
+_Static_assert(sizeof(struct page) == 32, "struct page must stay 32 bytes");
+
+#define PAGE_NO_PFN 0xFFFFFFFFU
+
+// Флаги кадра
+#define PG_RESERVED   0x0001   // не RAM или занят с загрузки, никогда не освобождается
+#define PG_LRU        0x0002   // стоит в каком-то page_list
+#define PG_DIRTY      0x0004
+#define PG_REFERENCED 0x0008
+#define PG_HEAD       0x0010   // первая страница блока порядка > 0
+#define PG_SLAB       0x0020   // страница slab'а кучи (order — порядок slab'а)
+
+// Кто владеет кадром
+#define PAGE_OWNER_FREE      0
+#define PAGE_OWNER_KERNEL    1
+#define PAGE_OWNER_PAGETABLE 2
+#define PAGE_OWNER_HEAP      3
+#define PAGE_OWNER_ANON      4
+#define PAGE_OWNER_PAGECACHE 5
+#define PAGE_OWNER_DMA       6
+
+extern struct page *page_frames;
+extern uint64_t page_frames_count;
+
+static inline struct page *pfn_to_page(uint64_t pfn) {
+    return pfn < page_frames_count ? &page_frames[pfn] : NULL;
+}
+
+static inline struct page *phys_to_page(uint64_t phys) {
+    return pfn_to_page(phys / PAGE_SIZE);
+}
+
+static inline uint64_t page_to_pfn(struct page *page) {
+    return (uint64_t)(page - page_frames);
+}
+
+static inline uint64_t page_to_phys(struct page *page) {
+    return page_to_pfn(page) * PAGE_SIZE;
+}
+
+// Ещё одна ссылка на уже занятый кадр (общие страницы, copy-on-write)
+static inline void page_get(struct page *page) {
+    __atomic_add_fetch(&page->refcount, 1, __ATOMIC_RELAXED);
+}
+
+// Снимает ссылку; последняя возвращает блок в PMM
+void page_put(struct page *page);
+
+// Двусвязный список кадров через lru_next/lru_prev (LRU, page cache)
+typedef struct {
+    uint32_t head;
+    uint32_t tail;
+    uint64_t count;
+} page_list_t;
+
+#define PAGE_LIST_INIT { PAGE_NO_PFN, PAGE_NO_PFN, 0 }
+
+void page_list_add(page_list_t *list, struct page *page);        // в голову
+void page_list_add_tail(page_list_t *list, struct page *page);
+void page_list_del(page_list_t *list, struct page *page);
+struct page *page_list_pop_tail(page_list_t *list);
@@ -1,74 +1,670 @@
 #include "pmm.h"
+#include "page.h"
+#include "arch/x86_64/cpu/cpu.h"
 #include <stdbool.h>
 
-static uint8_t *bitmap;
+// Иерархический индекс свободных страниц. Бит = 1 значит "свободно".
+// Уровень 0 — по биту на страницу, каждый следующий уровень — по биту
+// на слово предыдущего ("в этом слове есть свободный бит").
+// 3 уровня по 64 бита покрывают 2^18 страниц на одно верхнее слово (1 GB).
+#define PMM_INDEX_LEVELS 3
+#define PMM_NONE ((uint64_t)-1)
+
+struct pmm_index {
+    uint64_t *level[PMM_INDEX_LEVELS];
+    uint64_t words[PMM_INDEX_LEVELS];
+};
+
+// Зона — отдельный buddy-аллокатор над диапазоном [start_pfn, end_pfn).
+// Бит i в order_index[k] означает, что блок из 2^k страниц, начиная со
+// страницы start_pfn + (i << k), свободен целиком, а его "брат" (i ^ 1) — нет,
+// иначе они уже были бы слиты в блок порядка k + 1. Границы зон выровнены
+// по самому крупному блоку, так что выравнивание блоков абсолютное.
+struct pmm_zone {
+    const char *name;
+    uint64_t start_pfn;
+    uint64_t end_pfn;
+    struct pmm_index order_index[PMM_MAX_ORDER];
+    uint64_t order_hint[PMM_MAX_ORDER];   // next-fit для каждого порядка
+    uint64_t free_pages;                  // свободно в buddy, без учёта магазинов
+    uint64_t present_pages;
+};
+
+static struct pmm_zone zones[PMM_ZONE_COUNT] = {
+    [PMM_ZONE_DMA]    = { .name = "DMA",    .start_pfn = 0,                           .end_pfn = (16ULL << 20) / PAGE_SIZE },
+    [PMM_ZONE_DMA32]  = { .name = "DMA32",  .start_pfn = (16ULL << 20) / PAGE_SIZE,   .end_pfn = (4ULL << 30) / PAGE_SIZE },
+    [PMM_ZONE_NORMAL] = { .name = "Normal", .start_pfn = (4ULL << 30) / PAGE_SIZE,    .end_pfn = (uint64_t)-1 },
+};
+
 static uint64_t total_pages;
-static uint64_t bitmap_size;
 static uint64_t hhdm_off;
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+
+struct page *page_frames = NULL;
+uint64_t page_frames_count = 0;
+
+// Копия карты памяти: сам ответ Limine лежит в BOOTLOADER_RECLAIMABLE
+// и после pmm_reclaim_memory() перестанет существовать.
+#define PMM_MAX_MEMMAP 256
+static struct limine_memmap_entry memmap[PMM_MAX_MEMMAP];
+static uint64_t memmap_count;
+static uint64_t reclaimed_bytes;
+
+// Магазины: у каждого CPU свой стек свободных страниц порядка 0.
+// Пустой магазин добирает PMM_PCP_BATCH страниц из buddy за одно взятие
+// блокировки, полный — столько же возвращает. В общем случае alloc/free
+// трогают только локальную для CPU кэш-линию.
+#define PMM_PCP_HIGH  64
+#define PMM_PCP_BATCH 16
+
+struct pmm_pcp {
+    uint64_t count;
+    uint64_t pfn[PMM_PCP_HIGH];
+    pmm_pcp_stats_t stats;
+} __attribute__((aligned(64)));
+
+static struct pmm_pcp pcp[MAX_CPUS][PMM_ZONE_COUNT];
+
+// Пул заранее обнулённых страниц. Пополняется из idle-цикла, поэтому
+// pmm_alloc_zeroed_page() в общем случае не тратит время на обнуление.
+// Пул, как и магазин, у каждого CPU свой: таблицы страниц и #PF берут
+// обнулённые страницы постоянно, общая блокировка стала бы узким местом.
+// Для зоны DMA пула нет: она маленькая, держать её страницы про запас дорого.
+#define PMM_ZERO_POOL_SIZE  64
+#define PMM_ZERO_IDLE_BATCH 8
+
+struct pmm_zero_pool {
+    uint64_t count;
+    uint64_t pfn[PMM_ZERO_POOL_SIZE];
+} __attribute__((aligned(64)));
+
+static struct pmm_zero_pool zero_pool[MAX_CPUS][PMM_ZONE_COUNT];
+
+static const uint64_t zero_pool_target[PMM_ZONE_COUNT] = {
+    [PMM_ZONE_DMA32]  = 16,
+    [PMM_ZONE_NORMAL] = PMM_ZERO_POOL_SIZE,
+};
+
+static uint64_t index_words(uint64_t bits) { return (bits + 63) / 64; }
+
+static uint64_t index_size(uint64_t bits) {
+    uint64_t size = 0;
+    for (int lvl = 0; lvl < PMM_INDEX_LEVELS; lvl++) {
+        bits = index_words(bits);
+        size += bits * sizeof(uint64_t);
+    }
+    return size;
+}
+
+// Раскладывает уровни индекса по памяти mem; всё помечено как занятое.
+static uint64_t *index_init(struct pmm_index *idx, uint64_t bits, uint64_t *mem) {
+    for (int lvl = 0; lvl < PMM_INDEX_LEVELS; lvl++) {
+        bits = index_words(bits);
+        idx->level[lvl] = mem;
+        idx->words[lvl] = bits;
+        for (uint64_t i = 0; i < bits; i++) mem[i] = 0;
+        mem += bits;
+    }
+    return mem;
+}
+
+static bool index_test(struct pmm_index *idx, uint64_t bit) {
+    return idx->level[0][bit / 64] & (1ULL << (bit % 64));
+}
+
+// Помечает бит свободным и поднимает флаг "есть свободные" вверх по уровням,
+// пока слово не было непустым и до этого.
+static void index_set(struct pmm_index *idx, uint64_t bit) {
+    for (int lvl = 0; lvl < PMM_INDEX_LEVELS; lvl++) {
+        uint64_t *word = &idx->level[lvl][bit / 64];
+        bool was_empty = *word == 0;
+        *word |= 1ULL << (bit % 64);
+        if (!was_empty) return;
+        bit /= 64;
+    }
+}
+
+// Помечает бит занятым и сбрасывает флаг уровнем выше, если слово опустело.
+static void index_clear(struct pmm_index *idx, uint64_t bit) {
+    for (int lvl = 0; lvl < PMM_INDEX_LEVELS; lvl++) {
+        uint64_t *word = &idx->level[lvl][bit / 64];
+        *word &= ~(1ULL << (bit % 64));
+        if (*word != 0) return;
+        bit /= 64;
+    }
+}
+
+// Первый свободный бит уровня lvl с номером >= bit. Следующее непустое слово
+// ищется уровнем выше, поэтому поиск — O(уровней), а не O(памяти).
+static uint64_t index_find_from(struct pmm_index *idx, int lvl, uint64_t bit) {
+    uint64_t w = bit / 64;
+    if (w >= idx->words[lvl]) return PMM_NONE;
+
+    uint64_t word = idx->level[lvl][w] & (~0ULL << (bit % 64));
+    if (word) return w * 64 + __builtin_ctzll(word);
+
+    if (lvl == PMM_INDEX_LEVELS - 1) {
+        for (w++; w < idx->words[lvl]; w++) {
+            if (idx->level[lvl][w]) return w * 64 + __builtin_ctzll(idx->level[lvl][w]);
+        }
+        return PMM_NONE;
+    }
+
+    uint64_t next = index_find_from(idx, lvl + 1, w + 1);
+    if (next == PMM_NONE) return PMM_NONE;
+    return next * 64 + __builtin_ctzll(idx->level[lvl][next]);
+}
+
+static uint64_t index_find(struct pmm_index *idx, uint64_t hint) {
+    uint64_t bit = index_find_from(idx, 0, hint);
+    if (bit == PMM_NONE && hint != 0) bit = index_find_from(idx, 0, 0);
+    return bit;
+}
+
+static uint64_t zone_bits(struct pmm_zone *z, int order) {
+    return (z->end_pfn - z->start_pfn + (1ULL << order) - 1) >> order;
+}
+
+static struct pmm_zone *zone_of(uint64_t pfn) {
+    for (int i = PMM_ZONE_COUNT - 1; i >= 0; i--) {
+        if (pfn >= zones[i].start_pfn) return &zones[i];
+    }
+    return &zones[0];
+}
+
+// Возвращает блок в индекс, по пути сливая его со свободными братьями.
+static void buddy_free(struct pmm_zone *z, uint64_t pfn, int order) {
+    uint64_t block = (pfn - z->start_pfn) >> order;
+    while (order < PMM_MAX_ORDER - 1) {
+        uint64_t buddy = block ^ 1;
+        if (buddy >= zone_bits(z, order) || !index_test(&z->order_index[order], buddy)) break;
+        index_clear(&z->order_index[order], buddy);
+        block >>= 1;
+        order++;
+    }
+    index_set(&z->order_index[order], block);
+}
+
+// Берёт свободный блок наименьшего подходящего порядка и делит его пополам,
+// отдавая верхние половины обратно в индексы меньших порядков.
+static uint64_t buddy_alloc(struct pmm_zone *z, int order) {
+    if (z->free_pages < (1ULL << order)) return PMM_NONE;
+
+    for (int k = order; k < PMM_MAX_ORDER; k++) {
+        uint64_t block = index_find(&z->order_index[k], z->order_hint[k]);
+        if (block == PMM_NONE) continue;
+
+        index_clear(&z->order_index[k], block);
+        z->order_hint[k] = block + 1;
+        while (k > order) {
+            k--;
+            block <<= 1;
+            index_set(&z->order_index[k], block | 1);
+        }
+        return z->start_pfn + (block << order);
+    }
+    return PMM_NONE;
+}
+
+// Страница считается свободной, если её накрывает свободный блок любого порядка.
+static bool buddy_is_free(struct pmm_zone *z, uint64_t pfn) {
+    for (int k = 0; k < PMM_MAX_ORDER; k++) {
+        if (index_test(&z->order_index[k], (pfn - z->start_pfn) >> k)) return true;
+    }
+    return false;
+}
+
+static void page_mark_free(uint64_t pfn) {
+    struct page *page = &page_frames[pfn];
+    page->refcount = 0;
+    page->flags = 0;
+    page->owner = PAGE_OWNER_FREE;
+    page->order = 0;
+}
+
+static void page_mark_allocated(uint64_t pfn, int order) {
+    struct page *page = &page_frames[pfn];
+    page->refcount = 1;
+    page->flags = order ? PG_HEAD : 0;
+    page->owner = PAGE_OWNER_KERNEL;
+    page->order = order;
+    page->lru_next = page->lru_prev = PAGE_NO_PFN;
+    page->private = 0;
+    page->index = 0;
+}
+
+// Раздаёт диапазон [base, base + length) крупнейшими выровненными блоками,
+// не пересекая границ зон.
+static void buddy_free_range(uint64_t base, uint64_t length) {
+    uint64_t pfn = base / PAGE_SIZE;
+    uint64_t end = (base + length) / PAGE_SIZE;
+    for (uint64_t i = pfn; i < end; i++) page_mark_free(i);
+    while (pfn < end) {
+        struct pmm_zone *z = zone_of(pfn);
+        uint64_t limit = end < z->end_pfn ? end : z->end_pfn;
+        int order = 0;
+        while (order < PMM_MAX_ORDER - 1 &&
+               (pfn & ((2ULL << order) - 1)) == 0 &&
+               pfn + (2ULL << order) <= limit) {
+            order++;
+        }
+        buddy_free(z, pfn, order);
+        z->free_pages += 1ULL << order;
+        z->present_pages += 1ULL << order;
+        pfn += 1ULL << order;
+    }
+}
 
-static void bitmap_set(uint64_t bit) { bitmap[bit / 8] |= (1 << (bit % 8)); }
-static void bitmap_clear(uint64_t bit) { bitmap[bit / 8] &= ~(1 << (bit % 8)); }
-static bool bitmap_test(uint64_t bit) { return bitmap[bit / 8] & (1 << (bit % 8)); }
+// Страницы этих типов могут когда-либо стать свободными — только их и индексируем,
+// чтобы дыры и MMIO под 1 TB не раздували битмап.
+static bool memmap_is_ram(uint64_t type) {
+    return type == LIMINE_MEMMAP_USABLE ||
+           type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE ||
+           type == LIMINE_MEMMAP_ACPI_RECLAIMABLE ||
+           type == LIMINE_MEMMAP_KERNEL_AND_MODULES;
+}
 
 void pmm_init(struct limine_memmap_request *request, uint64_t hhdm_offset) {
     hhdm_off = hhdm_offset;
     struct limine_memmap_response *response = request->response;
     uint64_t max_address = 0;
 
-    for (uint64_t i = 0; i < response->entry_count; i++) {
-        struct limine_memmap_entry *entry = response->entries[i];
+    memmap_count = response->entry_count < PMM_MAX_MEMMAP ? response->entry_count : PMM_MAX_MEMMAP;
+    for (uint64_t i = 0; i < memmap_count; i++) memmap[i] = *response->entries[i];
+
+    for (uint64_t i = 0; i < memmap_count; i++) {
+        struct limine_memmap_entry *entry = &memmap[i];
+        if (!memmap_is_ram(entry->type)) continue;
         if (entry->base + entry->length > max_address) {
             max_address = entry->base + entry->length;
         }
     }
 
     total_pages = max_address / PAGE_SIZE;
-    bitmap_size = total_pages / 8;
-
-    bitmap = NULL;
-    for (uint64_t i = 0; i < response->entry_count; i++) {
-        struct limine_memmap_entry *entry = response->entries[i];
-        if (entry->type == LIMINE_MEMMAP_USABLE && entry->length >= bitmap_size) {
-            bitmap = (uint8_t *)(entry->base + hhdm_off);
-            entry->base += bitmap_size;
-            entry->length -= bitmap_size;
+
+    // Обрезаем зоны по реальному объёму памяти; зоны за его концом пустые
+    uint64_t index_bytes = 0;
+    for (int i = 0; i < PMM_ZONE_COUNT; i++) {
+        struct pmm_zone *z = &zones[i];
+        if (z->end_pfn > total_pages) z->end_pfn = total_pages;
+        if (z->start_pfn > z->end_pfn) z->start_pfn = z->end_pfn;
+        for (int k = 0; k < PMM_MAX_ORDER; k++) index_bytes += index_size(zone_bits(z, k));
+    }
+    uint64_t frames_bytes = total_pages * sizeof(struct page);
+    uint64_t carve_bytes = (frames_bytes + index_bytes + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+
+    // База кадров и индексы зон живут в начале первого подходящего региона.
+    // Сам регион в карте не трогаем: по ней строится прямое отображение
+    uint8_t *carve = NULL;
+    uint64_t carve_entry = 0;
+    for (uint64_t i = 0; i < memmap_count; i++) {
+        struct limine_memmap_entry *entry = &memmap[i];
+        if (entry->type == LIMINE_MEMMAP_USABLE && entry->length >= carve_bytes) {
+            carve = (uint8_t *)(entry->base + hhdm_off);
+            carve_entry = i;
             break;
         }
     }
 
-    if (!bitmap) return;
+    if (!carve) return;
+
+    // Пока не доказано обратное, кадр занят навсегда: дыры, ядро, сам carve
+    page_frames = (struct page *)carve;
+    page_frames_count = total_pages;
+    for (uint64_t pfn = 0; pfn < total_pages; pfn++) {
+        page_frames[pfn] = (struct page){
+            .refcount = 1, .flags = PG_RESERVED, .owner = PAGE_OWNER_KERNEL,
+            .lru_next = PAGE_NO_PFN, .lru_prev = PAGE_NO_PFN,
+        };
+    }
+
+    uint64_t *index_mem = (uint64_t *)(carve + frames_bytes);
 
-    for (uint64_t i = 0; i < bitmap_size; i++) bitmap[i] = 0xFF;
+    for (int i = 0; i < PMM_ZONE_COUNT; i++) {
+        for (int k = 0; k < PMM_MAX_ORDER; k++) {
+            index_mem = index_init(&zones[i].order_index[k], zone_bits(&zones[i], k), index_mem);
+            zones[i].order_hint[k] = 0;
+        }
+    }
 
-    for (uint64_t i = 0; i < response->entry_count; i++) {
-        struct limine_memmap_entry *entry = response->entries[i];
-        if (entry->type == LIMINE_MEMMAP_USABLE) {
-            for (uint64_t j = 0; j < entry->length; j += PAGE_SIZE) {
-                bitmap_clear((entry->base + j) / PAGE_SIZE);
-            }
+    for (uint64_t i = 0; i < memmap_count; i++) {
+        struct limine_memmap_entry *entry = &memmap[i];
+        if (entry->type != LIMINE_MEMMAP_USABLE) continue;
+        if (i == carve_entry) {
+            buddy_free_range(entry->base + carve_bytes, entry->length - carve_bytes);
+        } else {
+            buddy_free_range(entry->base, entry->length);
         }
     }
 }
 
-void *pmm_alloc_page() {
-    for (uint64_t i = 0; i < total_pages; i++) {
-        if (!bitmap_test(i)) {
-            bitmap_set(i);
-            return (void *)(i * PAGE_SIZE);
+// Отдаёт в аллокатор все регионы типа type. Вызывается, когда ядро уже
+// работает на своём стеке, своих таблицах страниц и копиях ответов Limine,
+// так что в этих регионах не осталось ничего живого. Регион помечается
+// как USABLE, так что повторный вызов ничего не освободит дважды.
+uint64_t pmm_reclaim_memory(uint64_t type) {
+    uint64_t gained = 0;
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    for (uint64_t i = 0; i < memmap_count; i++) {
+        struct limine_memmap_entry *entry = &memmap[i];
+        if (entry->type != type) continue;
+
+        // ACPI-регионы не обязаны быть выровнены по странице — берём только целые
+        uint64_t base = (entry->base + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+        uint64_t end = (entry->base + entry->length) & ~(uint64_t)(PAGE_SIZE - 1);
+        if (base < end) {
+            buddy_free_range(base, end - base);
+            gained += end - base;
         }
+        entry->type = LIMINE_MEMMAP_USABLE;
     }
-    return NULL; 
+
+    reclaimed_bytes += gained;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return gained;
+}
+
+uint64_t pmm_get_reclaimed_memory() {
+    return reclaimed_bytes;
 }
 
+// Политика отката: если в зоне пусто, спускаемся к более низким (и более
+// дефицитным) зонам, но никогда не поднимаемся выше запрошенной — устройство
+// с 32-битной адресацией не должно получить кадр за 4 GB.
+void *pmm_alloc_pages_zone(int order, int zone) {
+    if (order < 0 || order >= PMM_MAX_ORDER) return NULL;
+    if (zone < 0 || zone >= PMM_ZONE_COUNT) return NULL;
+
+    uint64_t pfn = PMM_NONE;
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    for (int i = zone; i >= 0 && pfn == PMM_NONE; i--) {
+        pfn = buddy_alloc(&zones[i], order);
+        if (pfn != PMM_NONE) zones[i].free_pages -= 1ULL << order;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    if (pfn == PMM_NONE) return NULL;
+    page_mark_allocated(pfn, order);
+    return (void *)(pfn * PAGE_SIZE);
+}
+
+void *pmm_alloc_pages(int order) {
+    return pmm_alloc_pages_zone(order, PMM_ZONE_NORMAL);
+}
+
+static void buddy_release(uint64_t pfn, int order) {
+    struct pmm_zone *z = zone_of(pfn);
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    if (!buddy_is_free(z, pfn)) {
+        buddy_free(z, pfn, order);
+        z->free_pages += 1ULL << order;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+void pmm_free_pages(void *addr, int order) {
+    uint64_t pfn = (uint64_t)addr / PAGE_SIZE;
+    if (order < 0 || order >= PMM_MAX_ORDER) return;
+    if (pfn & ((1ULL << order) - 1)) return;
+    if (pfn + (1ULL << order) > total_pages) return;
+    if (page_frames[pfn].refcount == 0 || (page_frames[pfn].flags & PG_RESERVED)) return;
+
+    page_mark_free(pfn);
+    buddy_release(pfn, order);
+}
+
+// Добирает пустой магазин из buddy своей зоны одной пачкой
+static void pcp_refill(struct pmm_pcp *cache, struct pmm_zone *z) {
+    spin_lock(&pmm_lock);
+    while (cache->count < PMM_PCP_BATCH) {
+        uint64_t pfn = buddy_alloc(z, 0);
+        if (pfn == PMM_NONE) break;
+        cache->pfn[cache->count++] = pfn;
+        z->free_pages--;
+    }
+    spin_unlock(&pmm_lock);
+    cache->stats.refills++;
+}
+
+// Отдаёт самые старые страницы полного магазина обратно в buddy
+static void pcp_drain(struct pmm_pcp *cache, struct pmm_zone *z, uint64_t n) {
+    spin_lock(&pmm_lock);
+    for (uint64_t i = 0; i < n; i++) {
+        buddy_free(z, cache->pfn[i], 0);
+    }
+    z->free_pages += n;
+    spin_unlock(&pmm_lock);
+
+    cache->count -= n;
+    for (uint64_t i = 0; i < cache->count; i++) cache->pfn[i] = cache->pfn[i + n];
+    cache->stats.drains++;
+}
+
+// Страница из магазина именно этой зоны, без отката; прерывания выключены
+static uint64_t pcp_alloc(int zone) {
+    struct pmm_pcp *cache = &pcp[cpu_id()][zone];
+    if (zones[zone].present_pages == 0) return PMM_NONE;
+
+    if (cache->count == 0) {
+        cache->stats.misses++;
+        pcp_refill(cache, &zones[zone]);
+    } else {
+        cache->stats.hits++;
+    }
+    if (cache->count == 0) return PMM_NONE;
+    return cache->pfn[--cache->count];
+}
+
+void *pmm_alloc_page_zone(int zone) {
+    if (zone < 0 || zone >= PMM_ZONE_COUNT) return NULL;
+
+    uint64_t pfn = PMM_NONE;
+    uint64_t flags = cpu_irq_save();
+    for (int i = zone; i >= 0 && pfn == PMM_NONE; i--) pfn = pcp_alloc(i);
+    cpu_irq_restore(flags);
+
+    if (pfn == PMM_NONE) return NULL;
+    page_mark_allocated(pfn, 0);
+    return (void *)(pfn * PAGE_SIZE);
+}
+
+void *pmm_alloc_page() {
+    return pmm_alloc_page_zone(PMM_ZONE_NORMAL);
+}
+
+static void pcp_release(uint64_t pfn) {
+    struct pmm_zone *z = zone_of(pfn);
+    uint64_t flags = cpu_irq_save();
+    struct pmm_pcp *cache = &pcp[cpu_id()][z - zones];
+    if (cache->count == PMM_PCP_HIGH) pcp_drain(cache, z, PMM_PCP_BATCH);
+    cache->pfn[cache->count++] = pfn;
+    cpu_irq_restore(flags);
+}
+
+// Двойное освобождение ловится по refcount в struct page — это строка
+// самого кадра, а не общий индекс, так что магазин остаётся локальным.
 void pmm_free_page(void *addr) {
-    uint64_t bit = (uint64_t)addr / PAGE_SIZE;
-    bitmap_clear(bit);
+    uint64_t pfn = (uint64_t)addr / PAGE_SIZE;
+    if (pfn >= total_pages) return;
+    if (page_frames[pfn].refcount == 0 || (page_frames[pfn].flags & PG_RESERVED)) return;
+
+    page_mark_free(pfn);
+    pcp_release(pfn);
 }
 
-uint64_t pmm_get_free_memory() {
-    uint64_t free_pages = 0;
-    for (uint64_t i = 0; i < total_pages; i++) {
-        if (!bitmap_test(i)) free_pages++;
+void page_put(struct page *page) {
+    if (page->flags & PG_RESERVED) return;
+    if (__atomic_sub_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+    uint64_t pfn = page_to_pfn(page);
+    int order = page->order;
+    page_mark_free(pfn);
+    if (order == 0) pcp_release(pfn);
+    else buddy_release(pfn, order);
+}
+
+// Списки кадров связаны через PFN, чтобы struct page оставалась 32-байтной
+void page_list_add(page_list_t *list, struct page *page) {
+    uint32_t pfn = page_to_pfn(page);
+    page->lru_prev = PAGE_NO_PFN;
+    page->lru_next = list->head;
+    if (list->head != PAGE_NO_PFN) page_frames[list->head].lru_prev = pfn;
+    else list->tail = pfn;
+    list->head = pfn;
+    list->count++;
+    page->flags |= PG_LRU;
+}
+
+void page_list_add_tail(page_list_t *list, struct page *page) {
+    uint32_t pfn = page_to_pfn(page);
+    page->lru_next = PAGE_NO_PFN;
+    page->lru_prev = list->tail;
+    if (list->tail != PAGE_NO_PFN) page_frames[list->tail].lru_next = pfn;
+    else list->head = pfn;
+    list->tail = pfn;
+    list->count++;
+    page->flags |= PG_LRU;
+}
+
+void page_list_del(page_list_t *list, struct page *page) {
+    if (page->lru_prev != PAGE_NO_PFN) page_frames[page->lru_prev].lru_next = page->lru_next;
+    else list->head = page->lru_next;
+    if (page->lru_next != PAGE_NO_PFN) page_frames[page->lru_next].lru_prev = page->lru_prev;
+    else list->tail = page->lru_prev;
+    page->lru_next = page->lru_prev = PAGE_NO_PFN;
+    list->count--;
+    page->flags &= ~PG_LRU;
+}
+
+struct page *page_list_pop_tail(page_list_t *list) {
+    if (list->tail == PAGE_NO_PFN) return NULL;
+    struct page *page = &page_frames[list->tail];
+    page_list_del(list, page);
+    return page;
+}
+
+// Обнуление "на потом": неблокирующие (non-temporal) записи не вытесняют
+// из кэша рабочие данные ради страницы, которую возьмут неизвестно когда.
+static void zero_page_nt(uint64_t pfn) {
+    uint64_t *p = (uint64_t *)(pfn * PAGE_SIZE + hhdm_off);
+    for (uint64_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i += 4) {
+        asm volatile("movnti %1, 0(%0)\n\t"
+                     "movnti %1, 8(%0)\n\t"
+                     "movnti %1, 16(%0)\n\t"
+                     "movnti %1, 24(%0)"
+                     :: "r"(p + i), "r"(0ULL) : "memory");
+    }
+}
+
+// Обнуление по требованию: страница сейчас пойдёт в работу, так что
+// обычный rep stosq заодно прогревает её в кэше.
+static void zero_page_now(uint64_t pfn) {
+    void *p = (void *)(pfn * PAGE_SIZE + hhdm_off);
+    uint64_t count = PAGE_SIZE / sizeof(uint64_t);
+    asm volatile("rep stosq" : "+D"(p), "+c"(count) : "a"(0ULL) : "memory");
+}
+
+void *pmm_alloc_zeroed_page_zone(int zone) {
+    if (zone < 0 || zone >= PMM_ZONE_COUNT) return NULL;
+
+    uint64_t pfn = PMM_NONE;
+    uint64_t flags = cpu_irq_save();
+    struct pmm_zero_pool *pool = zero_pool[cpu_id()];
+    for (int i = zone; i >= 0 && pfn == PMM_NONE; i--) {
+        if (pool[i].count > 0) pfn = pool[i].pfn[--pool[i].count];
     }
-    return free_pages * PAGE_SIZE;
-}
\ No newline at end of file
+    cpu_irq_restore(flags);
+    if (pfn != PMM_NONE) {
+        page_mark_allocated(pfn, 0);
+        return (void *)(pfn * PAGE_SIZE);
+    }
+
+    void *page = pmm_alloc_page_zone(zone);
+    if (page) zero_page_now((uint64_t)page / PAGE_SIZE);
+    return page;
+}
+
+void *pmm_alloc_zeroed_page() {
+    return pmm_alloc_zeroed_page_zone(PMM_ZONE_NORMAL);
+}
+
+// Вызывается из idle-цикла: обнуляет до PMM_ZERO_IDLE_BATCH страниц и
+// возвращает true, если пул ещё не полон и стоит позвать снова.
+bool pmm_zero_idle(void) {
+    for (int n = 0; n < PMM_ZERO_IDLE_BATCH; n++) {
+        // Пул зоны пополняется только её собственными кадрами: иначе при
+        // пустой Normal её пул набрал бы страниц DMA32 и учёт по зонам врал бы
+        int zone = -1;
+        uint64_t pfn = PMM_NONE;
+        uint64_t flags = cpu_irq_save();
+        struct pmm_zero_pool *pool = zero_pool[cpu_id()];
+        for (int i = PMM_ZONE_COUNT - 1; i >= 0 && pfn == PMM_NONE; i--) {
+            if (pool[i].count >= zero_pool_target[i]) continue;
+            pfn = pcp_alloc(i);
+            zone = i;
+        }
+        cpu_irq_restore(flags);
+        if (pfn == PMM_NONE) return false;
+
+        zero_page_nt(pfn);
+        asm volatile("sfence" ::: "memory");
+
+        flags = cpu_irq_save();
+        pool = &zero_pool[cpu_id()][zone];
+        if (pool->count < zero_pool_target[zone]) {
+            pool->pfn[pool->count++] = pfn;
+            pfn = PMM_NONE;
+        }
+        cpu_irq_restore(flags);
+        if (pfn != PMM_NONE) pcp_release(pfn);
+    }
+    return true;
+}
+
+void pmm_get_pcp_stats(pmm_pcp_stats_t *stats) {
+    stats->hits = stats->misses = stats->refills = stats->drains = 0;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        for (int i = 0; i < PMM_ZONE_COUNT; i++) {
+            stats->hits += pcp[cpu][i].stats.hits;
+            stats->misses += pcp[cpu][i].stats.misses;
+            stats->refills += pcp[cpu][i].stats.refills;
+            stats->drains += pcp[cpu][i].stats.drains;
+        }
+    }
+}
+
+uint64_t pmm_get_zone_free_memory(int zone) {
+    if (zone < 0 || zone >= PMM_ZONE_COUNT) return 0;
+    uint64_t pages = zones[zone].free_pages;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        pages += pcp[cpu][zone].count + zero_pool[cpu][zone].count;
+    }
+    return pages * PAGE_SIZE;
+}
+
+const char *pmm_get_zone_name(int zone) {
+    if (zone < 0 || zone >= PMM_ZONE_COUNT) return NULL;
+    return zones[zone].name;
+}
+
+// Конец самого старшего региона карты памяти любого типа (RAM, MMIO фреймбуфера)
+uint64_t pmm_get_phys_limit(void) {
+    uint64_t limit = 0;
+    for (uint64_t i = 0; i < memmap_count; i++) {
+        uint64_t end = memmap[i].base + memmap[i].length;
+        if (end > limit) limit = end;
+    }
+    return limit;
+}
+
+const struct limine_memmap_entry *pmm_get_memmap(uint64_t *count) {
+    *count = memmap_count;
+    return memmap;
+}
+
+uint64_t pmm_get_free_memory() {
+    uint64_t total = 0;
+    for (int i = 0; i < PMM_ZONE_COUNT; i++) total += pmm_get_zone_free_memory(i);
+    return total;
+}
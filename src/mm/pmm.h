@@ -1,13 +1,66 @@
 #pragma once
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include "include/limine.h"
 
 #define PAGE_SIZE 4096
 
+// Порядки buddy-аллокатора: блоки от 2^0 до 2^(PMM_MAX_ORDER-1) страниц (16 MB)
+#define PMM_MAX_ORDER 13
+
+// Зоны физической памяти. Аллокация в зоне Z может откатиться в более
+// низкие зоны, но никогда не выдаст кадр выше границы Z.
+#define PMM_ZONE_DMA    0   // < 16 MB, для ISA-подобных устройств
+#define PMM_ZONE_DMA32  1   // < 4 GB, для устройств с 32-битным DMA
+#define PMM_ZONE_NORMAL 2   // всё остальное; по умолчанию для ядра
+#define PMM_ZONE_COUNT  3
+
 void pmm_init(struct limine_memmap_request *request, uint64_t hhdm_offset);
 void *pmm_alloc_page();
+
+// Безусловно освобождает кадр; для общих кадров — page_put() из page.h
 void pmm_free_page(void *addr);
 
+// Физически непрерывные 2^order страниц, выровненные по своему размеру
+void *pmm_alloc_pages(int order);
+void pmm_free_pages(void *addr, int order);
+
+// То же, но не выше заданной зоны (PMM_ZONE_*)
+void *pmm_alloc_page_zone(int zone);
+void *pmm_alloc_pages_zone(int order, int zone);
+
+// Обнулённая страница: из пула, если он не пуст, иначе обнуляется на месте
+void *pmm_alloc_zeroed_page();
+void *pmm_alloc_zeroed_page_zone(int zone);
+
+// Фоновое пополнение пула обнулённых страниц; true — работа ещё осталась
+bool pmm_zero_idle(void);
+
+// Поздняя передача памяти загрузчика: освобождает все регионы карты памяти
+// типа type (LIMINE_MEMMAP_*) целиком. Вызывать, когда в них не осталось
+// ничего нужного: ядро на своём стеке и своих таблицах страниц, ответы
+// Limine скопированы, таблицы ACPI прочитаны. Возвращает байты.
+uint64_t pmm_reclaim_memory(uint64_t type);
+uint64_t pmm_get_reclaimed_memory();
+
+// Статистика per-CPU магазинов страниц (сумма по всем CPU)
+typedef struct {
+    uint64_t hits;     // alloc обслужен из локального магазина
+    uint64_t misses;   // магазин был пуст, пришлось идти в buddy
+    uint64_t refills;
+    uint64_t drains;
+} pmm_pcp_stats_t;
+
+void pmm_get_pcp_stats(pmm_pcp_stats_t *stats);
+
 // Возвращает количество свободной физической памяти в байтах
-uint64_t pmm_get_free_memory();
\ No newline at end of file
+uint64_t pmm_get_free_memory();
+uint64_t pmm_get_zone_free_memory(int zone);
+
+// Верхняя граница физических адресов из карты памяти (для прямого отображения)
+uint64_t pmm_get_phys_limit(void);
+
+// Копия карты памяти Limine, отсортированная по адресу; живёт всё время работы
+const struct limine_memmap_entry *pmm_get_memmap(uint64_t *count);
+const char *pmm_get_zone_name(int zone);
\ No newline at end of file
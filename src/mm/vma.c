@@ -0,0 +1,486 @@
+#include "vma.h"
+#include "heap.h"
+#include "pmm.h"
+#include "page.h"
+
+// Биты кода ошибки #PF
+#define PF_PRESENT 0x01
+#define PF_WRITE   0x02
+#define PF_USER    0x04
+#define PF_FETCH   0x10
+
+static vm_space_t kernel_space;
+static vm_space_t *current_space = &kernel_space;
+static kmem_cache_t *vma_cache = NULL;
+
+void vma_init(void) {
+    kernel_space.pml4 = vmm_get_kernel_pml4();
+    kernel_space.root = NULL;
+    kernel_space.cache = NULL;
+    kernel_space.brk_start = kernel_space.brk = USER_BRK_START;
+    kernel_space.lock = (spinlock_t)SPINLOCK_INIT;
+    vma_cache = kmem_cache_create("vma", sizeof(vma_t), 0, NULL);
+}
+
+vm_space_t *vm_space_kernel(void) { return &kernel_space; }
+vm_space_t *vm_space_current(void) { return current_space; }
+
+void vm_space_switch(vm_space_t *space) {
+    current_space = space;
+    vmm_switch(space->pml4);
+}
+
+// AVL-дерево по start. Регионы не пересекаются, поэтому порядок по end тот же.
+// Каждый узел хранит границы своего поддерева и самую большую дыру между
+// соседними регионами внутри него — по ним поиск места отсекает поддеревья.
+
+static inline int32_t vma_height(vma_t *n) { return n ? n->height : 0; }
+static inline uint64_t max_u64(uint64_t a, uint64_t b) { return a > b ? a : b; }
+
+static void vma_update(vma_t *n) {
+    vma_t *l = n->left, *r = n->right;
+    int32_t hl = vma_height(l), hr = vma_height(r);
+    n->height = 1 + (hl > hr ? hl : hr);
+    n->subtree_start = l ? l->subtree_start : n->start;
+    n->subtree_end = r ? r->subtree_end : n->end;
+    uint64_t gap = 0;
+    if (l) gap = max_u64(l->max_gap, n->start - l->subtree_end);
+    if (r) gap = max_u64(gap, max_u64(r->max_gap, r->subtree_start - n->end));
+    n->max_gap = gap;
+}
+
+static vma_t *vma_rotate_right(vma_t *n) {
+    vma_t *l = n->left;
+    n->left = l->right;
+    l->right = n;
+    vma_update(n);
+    vma_update(l);
+    return l;
+}
+
+static vma_t *vma_rotate_left(vma_t *n) {
+    vma_t *r = n->right;
+    n->right = r->left;
+    r->left = n;
+    vma_update(n);
+    vma_update(r);
+    return r;
+}
+
+static vma_t *vma_balance(vma_t *n) {
+    vma_update(n);
+    int32_t diff = vma_height(n->left) - vma_height(n->right);
+    if (diff > 1) {
+        if (vma_height(n->left->left) < vma_height(n->left->right)) n->left = vma_rotate_left(n->left);
+        return vma_rotate_right(n);
+    }
+    if (diff < -1) {
+        if (vma_height(n->right->right) < vma_height(n->right->left)) n->right = vma_rotate_right(n->right);
+        return vma_rotate_left(n);
+    }
+    return n;
+}
+
+static vma_t *vma_insert(vma_t *n, vma_t *vma) {
+    if (!n) {
+        vma->left = vma->right = NULL;
+        vma_update(vma);
+        return vma;
+    }
+    if (vma->start < n->start) n->left = vma_insert(n->left, vma);
+    else n->right = vma_insert(n->right, vma);
+    return vma_balance(n);
+}
+
+static vma_t *vma_erase_min(vma_t *n, vma_t **min) {
+    if (!n->left) {
+        *min = n;
+        return n->right;
+    }
+    n->left = vma_erase_min(n->left, min);
+    return vma_balance(n);
+}
+
+static vma_t *vma_erase(vma_t *n, vma_t *vma) {
+    if (n == vma) {
+        if (!n->left) return n->right;
+        if (!n->right) return n->left;
+        vma_t *min;
+        vma_t *right = vma_erase_min(n->right, &min);
+        min->left = n->left;
+        min->right = right;
+        return vma_balance(min);
+    }
+    if (vma->start < n->start) n->left = vma_erase(n->left, vma);
+    else n->right = vma_erase(n->right, vma);
+    return vma_balance(n);
+}
+
+static void vma_link(vm_space_t *space, vma_t *vma) {
+    space->root = vma_insert(space->root, vma);
+}
+
+static void vma_unlink(vm_space_t *space, vma_t *vma) {
+    space->root = vma_erase(space->root, vma);
+    if (space->cache == vma) space->cache = NULL;
+}
+
+// Первый регион, кончающийся после addr, — тот, что содержит addr, или следующий
+static vma_t *vma_first_after(vm_space_t *space, uint64_t addr) {
+    vma_t *found = NULL;
+    for (vma_t *n = space->root; n; ) {
+        if (n->end > addr) {
+            found = n;
+            n = n->left;
+        } else {
+            n = n->right;
+        }
+    }
+    return found;
+}
+
+// Последний регион, начинающийся до addr
+static vma_t *vma_last_before(vm_space_t *space, uint64_t addr) {
+    vma_t *found = NULL;
+    for (vma_t *n = space->root; n; ) {
+        if (n->start < addr) {
+            found = n;
+            n = n->right;
+        } else {
+            n = n->left;
+        }
+    }
+    return found;
+}
+
+static vma_t *vma_find(vm_space_t *space, uint64_t addr) {
+    // Подряд идущие #PF обычно приходятся на один регион
+    vma_t *vma = space->cache;
+    if (vma && vma->start <= addr && addr < vma->end) return vma;
+
+    vma = vma_first_after(space, addr);
+    if (!vma || vma->start > addr) return NULL;
+    space->cache = vma;
+    return vma;
+}
+
+static vma_t *vma_copy_tree(vma_t *n, bool *ok) {
+    if (!n || !*ok) return NULL;
+    vma_t *copy = kmem_cache_alloc(vma_cache);
+    if (!copy) {
+        *ok = false;
+        return NULL;
+    }
+    *copy = *n;
+    copy->left = vma_copy_tree(n->left, ok);
+    copy->right = vma_copy_tree(n->right, ok);
+    return copy;
+}
+
+static void vma_free_tree(vma_t *n) {
+    if (!n) return;
+    vma_free_tree(n->left);
+    vma_free_tree(n->right);
+    kmem_cache_free(vma_cache, n);
+}
+
+vm_space_t *vm_space_clone(vm_space_t *src) {
+    vm_space_t *space = kmalloc(sizeof(vm_space_t));
+    if (!space) return NULL;
+    space->cache = NULL;
+    space->brk_start = src->brk_start;
+    space->brk = src->brk;
+    space->lock = (spinlock_t)SPINLOCK_INIT;
+
+    // Стоимость — копия таблиц и дерева регионов; сами кадры общие до записи
+    uint64_t irq = spin_lock_irqsave(&src->lock);
+    bool copied = true;
+    space->root = vma_copy_tree(src->root, &copied);
+    space->pml4 = copied ? vmm_clone_address_space(src->pml4) : NULL;
+    spin_unlock_irqrestore(&src->lock, irq);
+
+    if (!space->pml4) {
+        vm_space_destroy(space);
+        return NULL;
+    }
+    return space;
+}
+
+void vm_space_destroy(vm_space_t *space) {
+    vma_free_tree(space->root);
+    if (space->pml4) vmm_destroy_address_space(space->pml4);
+    kfree(space);
+}
+
+static uint64_t vma_pte_flags(uint32_t flags) {
+    uint64_t pte = 0;
+    if (flags & VMA_WRITE) pte |= PTE_WRITABLE;
+    if (flags & VMA_USER) pte |= PTE_USER;
+    if (!(flags & VMA_EXEC)) pte |= PTE_NX;
+    return pte;
+}
+
+int vma_add(vm_space_t *space, uint64_t start, uint64_t size, uint32_t flags) {
+    uint64_t end = start + size;
+    if ((start | size) & (PAGE_SIZE - 1) || size == 0 || end < start) return -1;
+
+    vma_t *vma = kmem_cache_alloc(vma_cache);
+    if (!vma) return -1;
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    vma_t *next = vma_first_after(space, start);
+    if (next && next->start < end) {
+        spin_unlock_irqrestore(&space->lock, irq);
+        kmem_cache_free(vma_cache, vma);
+        return -1;
+    }
+
+    // Вплотную прилегающие соседи с теми же правами поглощаются новым узлом
+    vma_t *prev = vma_last_before(space, start);
+    if (prev && prev->end == start && prev->flags == flags) {
+        vma->start = prev->start;
+        vma_unlink(space, prev);
+        kmem_cache_free(vma_cache, prev);
+    }
+    if (next && next->start == end && next->flags == flags) {
+        vma->end = next->end;
+        vma_unlink(space, next);
+        kmem_cache_free(vma_cache, next);
+    }
+    vma_link(space, vma);
+    spin_unlock_irqrestore(&space->lock, irq);
+    return 0;
+}
+
+// Кадры отпускаются пачками: сначала собираем их из таблицы, затем один
+// vmm_unmap_range() снимает отображения и сбрасывает TLB, и только потом
+// ссылки отдаются — старых PTE к этому моменту не видит ни один CPU
+#define VMA_RELEASE_BATCH 64
+#define PT_SPAN (512 * PAGE_SIZE)
+
+static void vma_release_batch(vm_space_t *space, uint64_t start, uint64_t end,
+                              const uint64_t *frames, size_t count) {
+    vmm_unmap_range(space->pml4, start, end - start);
+    for (size_t i = 0; i < count; i++) page_put(phys_to_page(frames[i]));
+}
+
+// Снимает отображения [start, end) и отдаёт кадры анонимных страниц
+static void vma_release_pages(vm_space_t *space, uint64_t start, uint64_t end, uint32_t flags) {
+    if (!(flags & VMA_ANON)) {
+        vmm_unmap_range(space->pml4, start, end - start);
+        return;
+    }
+
+    uint64_t frames[VMA_RELEASE_BATCH];
+    size_t count = 0;
+    uint64_t batch_start = start;
+    uint64_t *pte = NULL;
+
+    for (uint64_t virt = start; virt < end; virt += PAGE_SIZE) {
+        // Обход идёт по листовой таблице; без неё пропускаем все её 2 МБ
+        if (!pte || !(virt & (PT_SPAN - 1))) {
+            pte = vmm_get_pte(space->pml4, virt, false);
+            if (!pte) {
+                virt = ((virt + PT_SPAN) & ~(PT_SPAN - 1)) - PAGE_SIZE;
+                continue;
+            }
+        } else {
+            pte++;
+        }
+        if (!(*pte & PTE_PRESENT)) continue;
+
+        frames[count++] = *pte & PTE_ADDR_MASK;
+        if (count == VMA_RELEASE_BATCH) {
+            // Снятие может освободить таблицу — дальше ищем её заново
+            vma_release_batch(space, batch_start, virt + PAGE_SIZE, frames, count);
+            batch_start = virt + PAGE_SIZE;
+            count = 0;
+            pte = NULL;
+        }
+    }
+    if (batch_start < end) vma_release_batch(space, batch_start, end, frames, count);
+}
+
+int vma_remove(vm_space_t *space, uint64_t start, uint64_t size) {
+    uint64_t end = start + size;
+    if ((start | size) & (PAGE_SIZE - 1) || size == 0 || end < start) return -1;
+
+    // Регион, накрывающий дыру целиком, делится на два — узел берём заранее
+    vma_t *spare = kmem_cache_alloc(vma_cache);
+    if (!spare) return -1;
+
+    // Каждый задетый регион вынимается из дерева, обрезается и остатки за
+    // пределами [start, end) вставляются обратно
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    vma_t *vma;
+    while ((vma = vma_first_after(space, start)) && vma->start < end) {
+        vma_unlink(space, vma);
+
+        uint64_t cut_start = max_u64(vma->start, start);
+        uint64_t cut_end = vma->end < end ? vma->end : end;
+        vma_release_pages(space, cut_start, cut_end, vma->flags);
+
+        if (vma->start < cut_start && vma->end > cut_end) {
+            spare->start = cut_end;
+            spare->end = vma->end;
+            spare->flags = vma->flags;
+            vma_link(space, spare);
+            spare = NULL;
+            vma->end = cut_start;
+            vma_link(space, vma);
+        } else if (vma->start < cut_start) {
+            vma->end = cut_start;
+            vma_link(space, vma);
+        } else if (vma->end > cut_end) {
+            vma->start = cut_end;
+            vma_link(space, vma);
+        } else {
+            kmem_cache_free(vma_cache, vma);
+        }
+    }
+    spin_unlock_irqrestore(&space->lock, irq);
+
+    if (spare) kmem_cache_free(vma_cache, spare);
+    return 0;
+}
+
+// Обход по порядку с отсечением: *prev — конец предыдущего региона. Поддерево
+// посещается, только если дыра нужного размера может оказаться внутри него.
+static uint64_t vma_gap_walk(vma_t *n, uint64_t low, uint64_t high, uint64_t size, uint64_t *prev) {
+    if (!n) return 0;
+    if (n->subtree_end <= low) {
+        *prev = n->subtree_end;
+        return 0;
+    }
+
+    // Дыра перед поддеревом
+    uint64_t from = max_u64(*prev, low);
+    uint64_t limit = n->subtree_start < high ? n->subtree_start : high;
+    if (from + size <= limit) return from;
+    if (n->subtree_start >= high) return 0;
+
+    if (n->max_gap < size) {
+        *prev = n->subtree_end;
+        return 0;
+    }
+
+    uint64_t addr = vma_gap_walk(n->left, low, high, size, prev);
+    if (addr) return addr;
+
+    from = max_u64(*prev, low);
+    limit = n->start < high ? n->start : high;
+    if (from + size <= limit) return from;
+    *prev = n->end;
+
+    return vma_gap_walk(n->right, low, high, size, prev);
+}
+
+uint64_t vma_find_gap(vm_space_t *space, uint64_t low, uint64_t high, uint64_t size) {
+    if (size == 0 || high < low || high - low < size) return 0;
+
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    uint64_t prev = low;
+    uint64_t addr = vma_gap_walk(space->root, low, high, size, &prev);
+    // Дыра после последнего региона
+    if (!addr && max_u64(prev, low) + size <= high) addr = max_u64(prev, low);
+    spin_unlock_irqrestore(&space->lock, irq);
+    return addr;
+}
+
+bool vma_lookup(vm_space_t *space, uint64_t addr, vma_t *out) {
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    vma_t *vma = vma_find(space, addr);
+    if (vma) *out = *vma;
+    spin_unlock_irqrestore(&space->lock, irq);
+    return vma != NULL;
+}
+
+// Отображает обнулённый кадр на page_addr; вызывается под замком пространства
+static bool vma_fault_page(vm_space_t *space, uint64_t page_addr, uint32_t flags) {
+    void *frame = pmm_alloc_zeroed_page();
+    if (!frame) return false;
+    phys_to_page((uint64_t)frame)->owner = PAGE_OWNER_ANON;
+
+    // Другой CPU мог успеть отобразить ту же страницу — тогда кадр не нужен
+    if (vmm_map(space->pml4, page_addr, (uint64_t)frame, vma_pte_flags(flags))) return true;
+    pmm_free_page(frame);
+    return vmm_is_mapped(space->pml4, page_addr);
+}
+
+bool vma_handle_fault(uint64_t addr, uint64_t error_code) {
+    // Верхняя половина всегда принадлежит ядру
+    vm_space_t *space = (addr >> 63) ? &kernel_space : current_space;
+    uint64_t page_addr = addr & PAGE_MASK;
+
+    // Замок держим до конца, чтобы регион не удалили между поиском и отображением
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    vma_t *vma = vma_find(space, addr);
+    uint32_t flags = vma ? vma->flags : 0;
+    bool ok = false;
+
+    if (!(flags & VMA_ANON) || !(flags & VMA_ACCESS)) goto out;
+    if ((error_code & PF_WRITE) && !(flags & VMA_WRITE)) goto out;
+    if ((error_code & PF_USER) && !(flags & VMA_USER)) goto out;
+    if ((error_code & PF_FETCH) && !(flags & VMA_EXEC)) goto out;
+
+    // Запись в общую после клонирования страницу — копируем её. Прочие
+    // нарушения прав на отображённой странице лениво не исправить
+    if (error_code & PF_PRESENT) {
+        if (error_code & PF_WRITE) ok = vmm_cow_fault(space->pml4, page_addr);
+        goto out;
+    }
+
+    ok = vma_fault_page(space, page_addr, flags);
+
+out:
+    spin_unlock_irqrestore(&space->lock, irq);
+    return ok;
+}
+
+// Заполняет [virt, end) одного региона: листовая таблица ищется (и
+// создаётся) один раз на PT_SPAN, дальше записи идут подряд
+static int vma_populate_range(vm_space_t *space, uint64_t virt, uint64_t end, uint32_t flags) {
+    uint64_t pte_flags = vma_pte_flags(flags);
+    uint64_t *pte = NULL;
+
+    for (; virt < end; virt += PAGE_SIZE) {
+        if (!pte || !(virt & (PT_SPAN - 1))) {
+            pte = vmm_get_pte(space->pml4, virt, true);
+            if (!pte) {
+                // Под большой страницей заполнять нечего
+                if (!vmm_is_mapped(space->pml4, virt)) return -1;
+                virt = ((virt + PT_SPAN) & ~(PT_SPAN - 1)) - PAGE_SIZE;
+                continue;
+            }
+        } else {
+            pte++;
+        }
+        if (*pte & PTE_PRESENT) continue;
+
+        void *frame = pmm_alloc_zeroed_page();
+        if (!frame) return -1;
+        phys_to_page((uint64_t)frame)->owner = PAGE_OWNER_ANON;
+        vmm_set_pte(pte, virt, (uint64_t)frame, pte_flags);
+    }
+    return 0;
+}
+
+int vma_populate(vm_space_t *space, uint64_t start, uint64_t size) {
+    uint64_t end = start + size;
+    int ret = 0;
+
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    vma_t *vma;
+    for (uint64_t virt = start & PAGE_MASK; virt < end && ret == 0; virt = vma->end) {
+        vma = vma_first_after(space, virt);
+        if (!vma || vma->start >= end) break;
+        if (!(vma->flags & VMA_ANON) || !(vma->flags & VMA_ACCESS)) continue;
+        if (virt < vma->start) virt = vma->start;
+        ret = vma_populate_range(space, virt, vma->end < end ? vma->end : end, vma->flags);
+    }
+    spin_unlock_irqrestore(&space->lock, irq);
+    return ret;
+}
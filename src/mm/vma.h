@@ -0,0 +1,80 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "arch/x86_64/paging/vmm/vmm.h"
+#include "arch/x86_64/cpu/cpu.h"
+
+// Регионы адресного пространства. Анонимный регион (VMA_ANON) резервирует
+// только адреса: кадры выделяются обнулёнными при первом обращении, в #PF.
+#define VMA_READ   0x01
+#define VMA_WRITE  0x02
+#define VMA_EXEC   0x04
+#define VMA_USER   0x08
+#define VMA_ANON   0x10
+
+// Регион PROT_NONE только занимает адреса: без этих прав он не отображается
+#define VMA_ACCESS (VMA_READ | VMA_WRITE | VMA_EXEC)
+
+// Пользовательская половина: куча brk растёт вверх от USER_BRK_START,
+// mmap без адреса ищет место в [USER_MMAP_START, USER_MMAP_END)
+#define USER_BRK_START   0x0000000040000000ULL
+#define USER_MMAP_START  0x0000100000000000ULL
+#define USER_MMAP_END    0x00007F0000000000ULL
+
+typedef struct vma {
+    uint64_t start;
+    uint64_t end;            // не включая
+    uint32_t flags;          // VMA_*
+    int32_t height;          // высота узла в AVL-дереве
+    struct vma* left;
+    struct vma* right;
+    uint64_t subtree_start;  // границы регионов поддерева
+    uint64_t subtree_end;
+    uint64_t max_gap;        // самая большая дыра между регионами поддерева
+} vma_t;
+
+typedef struct {
+    pml4_t* pml4;        // физический адрес PML4
+    vma_t* root;         // дерево регионов, без пересечений
+    vma_t* cache;        // последний найденный регион
+    uint64_t brk_start;  // начало кучи brk
+    uint64_t brk;        // текущий конец кучи, с точностью до байта
+    spinlock_t lock;
+} vm_space_t;
+
+void vma_init(void);
+
+// Пространство ядра (верхняя половина) и текущее пользовательское
+vm_space_t* vm_space_kernel(void);
+vm_space_t* vm_space_current(void);
+void vm_space_switch(vm_space_t* space);
+
+// Копия пространства: таблицы и регионы дублируются, анонимные страницы
+// становятся общими только для чтения и копируются при первой записи
+vm_space_t* vm_space_clone(vm_space_t* src);
+
+// Освобождает регионы, пользовательские таблицы и ссылки на кадры;
+// пространство не должно быть текущим
+void vm_space_destroy(vm_space_t* space);
+
+// Добавляет регион [start, start + size), сливая его с вплотную прилегающими
+// соседями с теми же флагами; -1 — пересечение или нет памяти
+int vma_add(vm_space_t* space, uint64_t start, uint64_t size, uint32_t flags);
+
+// Вырезает [start, start + size) из регионов, снимает отображения и
+// отпускает кадры анонимных страниц; -1 — пустой или невыровненный диапазон
+int vma_remove(vm_space_t* space, uint64_t start, uint64_t size);
+
+// Наименьший адрес в [low, high), с которого свободно size байт; 0 — места нет
+uint64_t vma_find_gap(vm_space_t* space, uint64_t low, uint64_t high, uint64_t size);
+
+// Заранее отображает ещё не тронутые страницы анонимных регионов в
+// [start, start + size); -1 — кончилась память
+int vma_populate(vm_space_t* space, uint64_t start, uint64_t size);
+
+// Копия региона, содержащего addr
+bool vma_lookup(vm_space_t* space, uint64_t addr, vma_t* out);
+
+// Разрешает #PF по адресу addr; false — обращение недопустимо
+bool vma_handle_fault(uint64_t addr, uint64_t error_code);
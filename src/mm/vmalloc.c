@@ -0,0 +1,230 @@
+#include "vmalloc.h"
+#include "heap.h"
+#include "pmm.h"
+#include "page.h"
+#include "vma.h"
+#include "arch/x86_64/paging/vmm/vmm.h"
+#include "arch/x86_64/cpu/cpu.h"
+
+// Занятые участки окна [VMALLOC_START, VMALLOC_END), по возрастанию адреса.
+// За каждым участком остаётся неотображённая guard-страница, чтобы выход за
+// конец буфера падал в #PF, а не портил соседа.
+struct vmap_area {
+    uint64_t start;
+    uint64_t size;
+    bool lazy;               // страницы приходят через #PF (vmalloc_reserve)
+    bool heap;               // выделен kmalloc'ом и учтён в счётчиках кучи
+    struct vmap_area *next;
+};
+
+static struct vmap_area *areas = NULL;
+static kmem_cache_t *area_cache = NULL;
+static spinlock_t vmalloc_lock = SPINLOCK_INIT;
+static uint64_t vmalloc_used = 0;
+
+void vmalloc_init(void) {
+    area_cache = kmem_cache_create("vmap_area", sizeof(struct vmap_area), 0, NULL);
+}
+
+// Первый промежуток, куда влезает size байт и guard-страница
+static struct vmap_area *area_reserve(uint64_t size) {
+    struct vmap_area *area = kmem_cache_alloc(area_cache);
+    if (!area) return NULL;
+    area->size = size;
+    area->lazy = false;
+    area->heap = false;
+
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+    uint64_t start = VMALLOC_START;
+    struct vmap_area **link = &areas;
+    while (*link && (*link)->start - start < size + PAGE_SIZE) {
+        start = (*link)->start + (*link)->size + PAGE_SIZE;
+        link = &(*link)->next;
+    }
+    if (VMALLOC_END - start < size + PAGE_SIZE) {
+        spin_unlock_irqrestore(&vmalloc_lock, flags);
+        kmem_cache_free(area_cache, area);
+        return NULL;
+    }
+    area->start = start;
+    area->next = *link;
+    *link = area;
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    return area;
+}
+
+static void area_release(struct vmap_area *area) {
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+    struct vmap_area **link = &areas;
+    while (*link != area) link = &(*link)->next;
+    *link = area->next;
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    kmem_cache_free(area_cache, area);
+}
+
+// Снимает страницы [first, first + count) участка и возвращает кадры в PMM.
+// Кадры участка принадлежат только ему, поэтому их можно собрать в список
+// и снять всё одним vmm_unmap_range() с одним сбросом TLB; в PMM они
+// уходят уже после сброса.
+static void area_unmap(struct vmap_area *area, uint64_t first, uint64_t count) {
+    pml4_t *pml4 = vmm_get_kernel_pml4();
+    uint64_t start = area->start + first * PAGE_SIZE;
+    uint64_t end = start + count * PAGE_SIZE;
+    page_list_t frames = PAGE_LIST_INIT;
+    uint64_t *pte = NULL;
+
+    for (uint64_t virt = start; virt < end; virt += PAGE_SIZE) {
+        // Новая листовая таблица — раз в 2 МБ
+        if (!pte || !(virt & (512 * PAGE_SIZE - 1))) pte = vmm_get_pte(pml4, virt, false);
+        else pte++;
+        if (pte && (*pte & PTE_PRESENT)) page_list_add_tail(&frames, phys_to_page(*pte & PTE_ADDR_MASK));
+    }
+
+    vmm_unmap_range(pml4, start, end - start);
+
+    struct page *page;
+    while ((page = page_list_pop_tail(&frames))) pmm_free_page((void *)page_to_phys(page));
+}
+
+// Отображает в участок новые кадры на страницы [first, first + count)
+static bool area_populate(struct vmap_area *area, uint64_t first, uint64_t count) {
+    pml4_t *pml4 = vmm_get_kernel_pml4();
+    for (uint64_t i = first; i < first + count; i++) {
+        void *frame = pmm_alloc_page();
+        if (!frame || !vmm_map(pml4, area->start + i * PAGE_SIZE, (uint64_t)frame, PTE_WRITABLE | PTE_NX)) {
+            if (frame) pmm_free_page(frame);
+            area_unmap(area, first, i - first);
+            return false;
+        }
+        struct page *page = phys_to_page((uint64_t)frame);
+        page->owner = PAGE_OWNER_HEAP;
+        page->index = i;
+    }
+    return true;
+}
+
+static struct vmap_area *area_find(const void *addr) {
+    uint64_t virt = (uint64_t)addr;
+    struct vmap_area *area = areas;
+    while (area && area->start + area->size <= virt) area = area->next;
+    return (area && area->start <= virt) ? area : NULL;
+}
+
+static void *vmalloc_area(size_t size, bool heap) {
+    if (size == 0 || !area_cache) return NULL;
+    uint64_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    struct vmap_area *area = area_reserve(pages * PAGE_SIZE);
+    if (!area) return NULL;
+    area->heap = heap;
+
+    if (!area_populate(area, 0, pages)) {
+        area_release(area);
+        return NULL;
+    }
+
+    __atomic_add_fetch(&vmalloc_used, pages * PAGE_SIZE, __ATOMIC_RELAXED);
+    return (void *)area->start;
+}
+
+void *vmalloc(size_t size) {
+    return vmalloc_area(size, false);
+}
+
+void *vmalloc_heap(size_t size) {
+    return vmalloc_area(size, true);
+}
+
+// Только резервирует адреса: каждая страница выделяется обнулённой при
+// первом обращении, поэтому большой редко заполняемый буфер почти бесплатен
+void *vmalloc_reserve(size_t size) {
+    if (size == 0 || !area_cache) return NULL;
+    uint64_t bytes = (size + PAGE_SIZE - 1) & PAGE_MASK;
+
+    struct vmap_area *area = area_reserve(bytes);
+    if (!area) return NULL;
+    area->lazy = true;
+
+    if (vma_add(vm_space_kernel(), area->start, bytes, VMA_READ | VMA_WRITE | VMA_ANON) != 0) {
+        area_release(area);
+        return NULL;
+    }
+    return (void *)area->start;
+}
+
+void vfree(void *addr) {
+    if (addr == NULL) return;
+
+    // Участок снимается со списка сразу, чтобы повторный vfree его не нашёл
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+    struct vmap_area **link = &areas;
+    while (*link && (*link)->start < (uint64_t)addr) link = &(*link)->next;
+    struct vmap_area *area = *link;
+    if (!area || area->start != (uint64_t)addr) {
+        spin_unlock_irqrestore(&vmalloc_lock, flags);
+        return;
+    }
+    *link = area->next;
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+
+    if (area->lazy) {
+        vma_remove(vm_space_kernel(), area->start, area->size);
+    } else {
+        area_unmap(area, 0, area->size / PAGE_SIZE);
+        __atomic_sub_fetch(&vmalloc_used, area->size, __ATOMIC_RELAXED);
+    }
+    kmem_cache_free(area_cache, area);
+}
+
+// Доращивает участок на месте, если до соседа хватает места с guard-страницей
+bool vmalloc_grow(void *addr, size_t size) {
+    uint64_t new_size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+    struct vmap_area *area = area_find(addr);
+    if (!area || area->start != (uint64_t)addr || area->lazy) {
+        spin_unlock_irqrestore(&vmalloc_lock, flags);
+        return false;
+    }
+    uint64_t old_size = area->size;
+    uint64_t limit = area->next ? area->next->start : VMALLOC_END;
+    if (new_size <= old_size || limit - area->start < new_size + PAGE_SIZE) {
+        spin_unlock_irqrestore(&vmalloc_lock, flags);
+        return new_size <= old_size;
+    }
+    area->size = new_size;   // место занято, пока страницы отображаются
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+
+    if (!area_populate(area, old_size / PAGE_SIZE, (new_size - old_size) / PAGE_SIZE)) {
+        flags = spin_lock_irqsave(&vmalloc_lock);
+        area->size = old_size;
+        spin_unlock_irqrestore(&vmalloc_lock, flags);
+        return false;
+    }
+    __atomic_add_fetch(&vmalloc_used, new_size - old_size, __ATOMIC_RELAXED);
+    return true;
+}
+
+bool is_vmalloc_addr(const void *addr) {
+    return (uint64_t)addr >= VMALLOC_START && (uint64_t)addr < VMALLOC_END;
+}
+
+// Только начало области: kfree() указателя внутрь блока не должен трогать
+// счётчики кучи, ведь vfree() такой указатель всё равно проигнорирует
+bool vmalloc_is_heap(const void *addr) {
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+    struct vmap_area *area = area_find(addr);
+    bool heap = area && area->heap && area->start == (uint64_t)addr;
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    return heap;
+}
+
+size_t vmalloc_size(const void *addr) {
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+    struct vmap_area *area = area_find(addr);
+    size_t size = area ? area->size : 0;
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    return size;
+}
+
+uint64_t vmalloc_get_used(void) { return vmalloc_used; }
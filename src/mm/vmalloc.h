@@ -0,0 +1,31 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Виртуально непрерывная память ядра из произвольных физических кадров.
+// Для больших буферов, которым не нужна физическая непрерывность.
+void vmalloc_init(void);
+void* vmalloc(size_t size);
+void vfree(void* addr);
+
+// То же для крупных блоков kmalloc: область помечается как часть кучи,
+// и kfree знает, что её надо вычесть из счётчиков кучи
+void* vmalloc_heap(size_t size);
+
+// true, только если addr — начало такой области
+bool vmalloc_is_heap(const void* addr);
+
+// Резерв без кадров: страницы появляются обнулёнными при первом касании
+void* vmalloc_reserve(size_t size);
+
+// Увеличивает область на месте до size байт; false — мешает сосед или нет памяти
+bool vmalloc_grow(void* addr, size_t size);
+
+bool is_vmalloc_addr(const void* addr);
+
+// Размер области, которой принадлежит адрес (0 — не из vmalloc)
+size_t vmalloc_size(const void* addr);
+
+// Байт в отображённых страницах vmalloc (без ленивых резервов)
+uint64_t vmalloc_get_used(void);
@@ -2,6 +2,7 @@
 #include "../arch/x86_64/paging/vmm/vmm.h"
 #include "../mm/pmm.h"
 #include "../mm/heap.h"
+#include "../mm/vma.h"
 
 // ============================================================================
 // Syscall Handlers
@@ -44,11 +45,98 @@ uint64_t sys_getpid(void) {
     return 1;
 }
 
+// ============================================================================
+// Syscall: mmap / munmap
+// ============================================================================
+
+// Only anonymous private memory exists so far: the range is recorded as a VMA
+// and pages are zero-filled on first touch by the page fault handler
+
+static bool user_range_ok(uint64_t addr, uint64_t length) {
+    return addr >= PAGE_SIZE && length <= USER_END && addr <= USER_END - length;
+}
+
+static uint32_t prot_to_vma(uint64_t prot) {
+    uint32_t flags = VMA_USER | VMA_ANON;
+    if (prot & PROT_READ) flags |= VMA_READ;
+    if (prot & PROT_WRITE) flags |= VMA_WRITE;
+    if (prot & PROT_EXEC) flags |= VMA_EXEC;
+    return flags;
+}
+
+uint64_t sys_mmap(uint64_t addr, uint64_t length, uint64_t prot, uint64_t flags) {
+    if (length == 0 || length > USER_END) return MAP_FAILED;
+    if (!(flags & MAP_ANONYMOUS) || (flags & MAP_SHARED) || !(flags & MAP_PRIVATE)) return MAP_FAILED;
+    
+    length = (length + PAGE_SIZE - 1) & PAGE_MASK;
+    vm_space_t* space = vm_space_current();
+    uint32_t vma_flags = prot_to_vma(prot);
+    
+    if (flags & MAP_FIXED) {
+        if ((addr & (PAGE_SIZE - 1)) || !user_range_ok(addr, length)) return MAP_FAILED;
+        vma_remove(space, addr, length);
+        if (vma_add(space, addr, length, vma_flags) != 0) return MAP_FAILED;
+    } else if (!addr || (addr & (PAGE_SIZE - 1)) || !user_range_ok(addr, length) ||
+               vma_add(space, addr, length, vma_flags) != 0) {
+        // The hint is unusable or taken: pick a hole, 2 MiB aligned for large
+        // requests so the range can later be backed by huge pages
+        uint64_t align = length >= MMAP_HUGE_ALIGN ? MMAP_HUGE_ALIGN : PAGE_SIZE;
+        uint64_t gap = vma_find_gap(space, USER_MMAP_START, USER_MMAP_END, length + align - PAGE_SIZE);
+        if (!gap) return MAP_FAILED;
+        
+        addr = (gap + align - 1) & ~(align - 1);
+        if (vma_add(space, addr, length, vma_flags) != 0) return MAP_FAILED;
+    }
+    
+    if ((flags & MAP_POPULATE) && vma_populate(space, addr, length) != 0) {
+        vma_remove(space, addr, length);
+        return MAP_FAILED;
+    }
+    return addr;
+}
+
+int64_t sys_munmap(uint64_t addr, uint64_t length) {
+    if (length == 0 || (addr & (PAGE_SIZE - 1))) return -1;
+    
+    length = (length + PAGE_SIZE - 1) & PAGE_MASK;
+    if (!user_range_ok(addr, length)) return -1;
+    
+    return vma_remove(vm_space_current(), addr, length);
+}
+
+// ============================================================================
+// Syscall: brk
+// ============================================================================
+
+// Returns the new break, or the old one if it cannot move. Growth adds an
+// anonymous VMA that merges with the heap's existing one.
+uint64_t sys_brk(uint64_t new_brk) {
+    vm_space_t* space = vm_space_current();
+    if (new_brk < space->brk_start || new_brk > USER_MMAP_START) return space->brk;
+    
+    uint64_t old_end = (space->brk + PAGE_SIZE - 1) & PAGE_MASK;
+    uint64_t new_end = (new_brk + PAGE_SIZE - 1) & PAGE_MASK;
+    
+    if (new_end > old_end) {
+        if (vma_add(space, old_end, new_end - old_end, VMA_READ | VMA_WRITE | VMA_USER | VMA_ANON) != 0) {
+            return space->brk;
+        }
+    } else if (new_end < old_end) {
+        vma_remove(space, new_end, old_end - new_end);
+    }
+    
+    space->brk = new_brk;
+    return new_brk;
+}
+
 // ============================================================================
 // Main Syscall Handler
 // ============================================================================
 
-uint64_t syscall_handler(uint64_t syscall_nr, uint64_t arg1, uint64_t arg2, uint64_t arg3) {
+uint64_t syscall_handler(uint64_t syscall_nr, uint64_t arg1, uint64_t arg2, uint64_t arg3,
+                         uint64_t arg4, uint64_t arg5, uint64_t arg6) {
+    (void)arg5; (void)arg6;  // mmap's fd and offset: anonymous mappings only
+    
     if (syscall_nr >= SYS_NR) {
         return -1;
     }
@@ -63,6 +151,12 @@ uint64_t syscall_handler(uint64_t syscall_nr, uint64_t arg1, uint64_t arg2, uint
             return 0;
         case SYS_GETPID:
             return sys_getpid();
+        case SYS_MMAP:
+            return sys_mmap(arg1, arg2, arg3, arg4);
+        case SYS_MUNMAP:
+            return sys_munmap(arg1, arg2);
+        case SYS_BRK:
+            return sys_brk(arg1);
         default:
             return -1;
     }
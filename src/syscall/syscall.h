@@ -35,16 +35,24 @@
 #define MAP_PRIVATE     0x02
 #define MAP_FIXED       0x10
 #define MAP_ANONYMOUS   0x20
+#define MAP_POPULATE    0x8000  // Back the whole range before returning
 
+#define PROT_NONE       0x00
 #define PROT_READ       0x01
 #define PROT_WRITE      0x02
 #define PROT_EXEC       0x04
 
+#define MAP_FAILED      ((uint64_t)-1)
+
+// Requests at least this large are placed on a 2 MiB boundary
+#define MMAP_HUGE_ALIGN 0x200000ULL
+
 // ============================================================================
 // System Call API
 // ============================================================================
 
 void syscall_init(void);
-uint64_t syscall_handler(uint64_t syscall_nr, uint64_t arg1, uint64_t arg2, uint64_t arg3);
+uint64_t syscall_handler(uint64_t syscall_nr, uint64_t arg1, uint64_t arg2, uint64_t arg3,
+                         uint64_t arg4, uint64_t arg5, uint64_t arg6);
 
 #endif // SYSCALL_H